@@ -0,0 +1,526 @@
+// bench.cpp : Micro benchmarks for the hermesw script loading paths.
+//
+// Only uses portable code besides the bits under _WIN32, so it also builds on
+// Linux, against the same Hermes libraries bench.vcxproj links, plus hermesw
+// and ../test/{BaseScriptStoreImpl,Crc32c}.cpp. See CMakeLists.txt.
+//
+// bench --startup-json [path] runs the startup benchmark only and writes its
+// results as JSON, to stdout by default, for tracking across Hermes upgrades.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/stat.h>
+#endif
+
+#include <jsi/ScriptHash.h>
+
+#include <CompileJS.h>
+#include <hermes.h>
+
+#include "BaseScriptStoreImpl.h"
+#include "hermesw/hermesw.h"
+
+namespace {
+
+std::atomic<uint64_t> g_allocations{0};
+std::atomic<uint64_t> g_allocated_bytes{0};
+
+} // namespace
+
+// Counts every allocation made through operator new by this module. On Windows
+// each module has its own operator new, so allocations made inside hermesw.dll
+// are only counted when it is linked statically. Elsewhere this replaces
+// operator new for the whole process.
+void *operator new(size_t size) {
+  g_allocations++;
+  g_allocated_bytes += size;
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double elapsedMs(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// Generates a syntactically valid bundle of roughly the requested size, made of
+// many small functions so that the compiler sees a realistic shape rather than
+// one huge literal.
+std::string makeSyntheticBundle(size_t targetSize) {
+  std::string bundle;
+  bundle.reserve(targetSize + 256);
+
+  char fn[256];
+  for (int i = 0; bundle.size() < targetSize; i++) {
+    snprintf(
+        fn,
+        sizeof(fn),
+        "function f%d(a, b) { var s = 'item%d'; for (var i = 0; i < a; i++) "
+        "{ b = (b * 31 + i) | 0; } return s + b; }\n",
+        i,
+        i);
+    bundle.append(fn);
+  }
+  bundle.append("print(f0(10, 1));\n");
+  return bundle;
+}
+
+// Hash throughput vs. a cold compile of the same bundle. The content hash is
+// computed on every evaluateJavaScript call, so it has to stay a rounding error
+// compared to the compile it saves.
+void benchHashVsCompile() {
+  const size_t sizes[] = {100 * 1024, 1024 * 1024, 10 * 1024 * 1024};
+
+  printf(
+      "%-12s %12s %12s %12s %10s\n",
+      "bundle",
+      "hash(ms)",
+      "hash(MB/s)",
+      "compile(ms)",
+      "ratio");
+
+  for (size_t size : sizes) {
+    std::string bundle = makeSyntheticBundle(size);
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(bundle.data());
+
+    constexpr int HASH_ITERATIONS = 20;
+    facebook::jsi::ScriptVersion_t version = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < HASH_ITERATIONS; i++) {
+      version ^= facebook::jsi::computeScriptVersion(data, bundle.size());
+    }
+    double hashMs = elapsedMs(start) / HASH_ITERATIONS;
+
+    std::string bytecode;
+    start = Clock::now();
+    bool compiled = ::hermes::compileJS(bundle, "bench.js", bytecode);
+    double compileMs = elapsedMs(start);
+
+    printf(
+        "%-12zu %12.3f %12.1f %12.3f %10.0f%s\n",
+        bundle.size(),
+        hashMs,
+        (bundle.size() / (1024.0 * 1024.0)) / (hashMs / 1000.0),
+        compileMs,
+        compileMs / hashMs,
+        compiled ? "" : " (compile failed)");
+
+    // Keep the hash loop from being optimized away.
+    if (version == 0)
+      printf("unexpected zero version\n");
+  }
+}
+
+class StringBuffer : public facebook::jsi::Buffer {
+ public:
+  StringBuffer(std::string str) : str_(std::move(str)) {}
+
+  size_t size() const override {
+    return str_.size();
+  }
+  const uint8_t *data() const override {
+    return reinterpret_cast<const uint8_t *>(str_.data());
+  }
+
+ private:
+  std::string str_;
+};
+
+struct AllocationCounts {
+  uint64_t allocations;
+  uint64_t bytes;
+};
+
+AllocationCounts countAllocations(std::function<void()> fn) {
+  uint64_t allocations = g_allocations;
+  uint64_t bytes = g_allocated_bytes;
+  fn();
+  return {g_allocations - allocations, g_allocated_bytes - bytes};
+}
+
+constexpr const char *BENCH_STORE_DIRECTORY = "bench_store/";
+
+void makeBenchStoreDirectory() {
+#ifdef _WIN32
+  _mkdir(BENCH_STORE_DIRECTORY);
+#else
+  mkdir(BENCH_STORE_DIRECTORY, 0755);
+#endif
+}
+
+// Salted so that the first load is a miss even if the store is reused.
+std::string saltBundle(std::string bundle) {
+  return bundle + "// " +
+      std::to_string(Clock::now().time_since_epoch().count()) + "\n";
+}
+
+// Allocations made by a cold load (compile and persist) and a warm load (store
+// hit) through makeDynamicPreparedScriptHermesRuntime. The compiler's own
+// allocations dominate the cold load; what's left beyond them is copies of the
+// source and of the bytecode, which should stay at one source copy.
+void benchEvaluateAllocations() {
+  makeBenchStoreDirectory();
+
+  const size_t sizes[] = {100 * 1024, 1024 * 1024, 10 * 1024 * 1024};
+
+  printf(
+      "\n%-12s %12s %12s %12s %12s\n",
+      "bundle",
+      "cold(allocs)",
+      "cold(MB)",
+      "warm(allocs)",
+      "warm(MB)");
+
+  for (size_t size : sizes) {
+    std::shared_ptr<const facebook::jsi::Buffer> source =
+        std::make_shared<StringBuffer>(saltBundle(makeSyntheticBundle(size)));
+
+    AllocationCounts counts[2];
+    for (AllocationCounts &count : counts) {
+      auto runtime = makeDynamicPreparedScriptHermesRuntime(
+          std::make_unique<facebook::react::BasePreparedScriptStoreImpl>(
+              BENCH_STORE_DIRECTORY));
+      count = countAllocations(
+          [&]() { runtime->evaluateJavaScript(source, "bench.js"); });
+    }
+
+    printf(
+        "%-12zu %12" PRIu64 " %12.2f %12" PRIu64 " %12.2f\n",
+        source->size(),
+        counts[0].allocations,
+        counts[0].bytes / (1024.0 * 1024.0),
+        counts[1].allocations,
+        counts[1].bytes / (1024.0 * 1024.0));
+  }
+}
+
+struct JsiCallTimes {
+  double getPropertyNs;
+  double callNs;
+};
+
+JsiCallTimes timeJsiCalls(facebook::jsi::Runtime &rt) {
+  rt.evaluateJavaScript(
+      std::make_shared<StringBuffer>(
+          "var o = {x: 1}; function f(a) { return a; }"),
+      "bench.js");
+
+  facebook::jsi::Object o = rt.global().getPropertyAsObject(rt, "o");
+  facebook::jsi::Function f = rt.global().getPropertyAsFunction(rt, "f");
+  facebook::jsi::PropNameID x = facebook::jsi::PropNameID::forAscii(rt, "x");
+
+  constexpr int ITERATIONS = 1000000;
+
+  auto start = Clock::now();
+  for (int i = 0; i < ITERATIONS; i++) {
+    o.getProperty(rt, x);
+  }
+  double getPropertyNs = elapsedMs(start) * 1e6 / ITERATIONS;
+
+  start = Clock::now();
+  for (int i = 0; i < ITERATIONS; i++) {
+    f.call(rt, i);
+  }
+  double callNs = elapsedMs(start) * 1e6 / ITERATIONS;
+
+  return {getPropertyNs, callNs};
+}
+
+// Cost of plain JSI calls through the DynamicPreparedScriptHermesRuntime
+// decorator vs straight on the Hermes runtime.
+void benchJsiCallOverhead() {
+  printf("\n%-12s %16s %16s\n", "runtime", "getProperty(ns)", "call(ns)");
+
+  auto decorated = makeDynamicPreparedScriptHermesRuntime(nullptr);
+  JsiCallTimes times = timeJsiCalls(*decorated);
+  printf(
+      "%-12s %16.1f %16.1f\n", "decorated", times.getPropertyNs, times.callNs);
+
+  DirectHermesRuntime direct = makeDirectPreparedScriptHermesRuntime(
+      nullptr, nullptr, PreparedScriptCompileMode::Synchronous);
+  times = timeJsiCalls(*direct.runtime);
+  printf("%-12s %16.1f %16.1f\n", "direct", times.getPropertyNs, times.callNs);
+}
+
+struct NamedRuntimeConfig {
+  const char *name;
+  HermesRuntimeConfig config;
+};
+
+const NamedRuntimeConfig RUNTIME_CONFIGS[] = {
+    {"default", {}},
+    {"small-heap", {1 << 20, 32 << 20, 0, false}},
+    {"large-heap", {64 << 20, 1024u << 20, 0, false}},
+};
+
+uint64_t getPeakRss() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  // Kilobytes on Linux.
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+// Runs in a process of its own, the peak RSS would carry over otherwise.
+void runConfigWorkload(const NamedRuntimeConfig &named) {
+  // Allocation heavy, with a live set of a few MB and lots of garbage.
+  auto workload = std::make_shared<StringBuffer>(
+      "var keep = [];"
+      "for (var round = 0; round < 20; round++) {"
+      "  for (var i = 0; i < 100000; i++) {"
+      "    var o = {i: i, s: 'item' + i, a: [i, i + 1]};"
+      "    if (i % 50 == 0) keep[(round * 100000 + i) % 40000] = o;"
+      "  }"
+      "}"
+      "keep.length;");
+
+  auto start = Clock::now();
+  {
+    DirectHermesRuntime direct = makeDirectPreparedScriptHermesRuntime(
+        nullptr, nullptr, PreparedScriptCompileMode::Synchronous, named.config);
+    direct.loader->evaluateJavaScript(workload, "workload.js");
+  }
+  double wallMs = elapsedMs(start);
+
+  printf(
+      "%-12s %12.1f %12.1f\n",
+      named.name,
+      wallMs,
+      getPeakRss() / (1024.0 * 1024.0));
+}
+
+void benchRuntimeConfigs(const char *self) {
+  printf("\n%-12s %12s %12s\n", "config", "wall(ms)", "peakRSS(MB)");
+  fflush(stdout);
+
+  for (size_t i = 0; i < sizeof(RUNTIME_CONFIGS) / sizeof(RUNTIME_CONFIGS[0]);
+       i++) {
+    std::string command =
+        std::string("\"") + self + "\" --runtime-config " + std::to_string(i);
+    if (std::system(command.c_str()) != 0)
+      printf("%-12s failed\n", RUNTIME_CONFIGS[i].name);
+    fflush(stdout);
+  }
+}
+
+// Time to the first instruction of a bundle and to the end of its evaluation.
+struct StartupTimes {
+  double ttfiMs;
+  double totalMs;
+};
+
+// Loads the bundle into a fresh runtime through the given store, or straight
+// from source without one, and adds its times to samples. Bundles start with a
+// call to __benchMark, which records when their first instruction ran; a load
+// which fails before that has no time to the first instruction and is dropped.
+void timeStartup(
+    std::unique_ptr<facebook::jsi::PreparedScriptStore> store,
+    const std::shared_ptr<const facebook::jsi::Buffer> &bundle,
+    std::vector<StartupTimes> &samples) {
+  DirectHermesRuntime direct = makeDirectPreparedScriptHermesRuntime(
+      nullptr, std::move(store), PreparedScriptCompileMode::Synchronous);
+  facebook::jsi::Runtime &rt = *direct.runtime;
+
+  bool benchMarked = false;
+  Clock::time_point firstInstruction = Clock::time_point::min();
+  rt.global().setProperty(
+      rt,
+      "__benchMark",
+      facebook::jsi::Function::createFromHostFunction(
+          rt,
+          facebook::jsi::PropNameID::forAscii(rt, "__benchMark"),
+          0,
+          [&benchMarked, &firstInstruction](
+              facebook::jsi::Runtime &,
+              const facebook::jsi::Value &,
+              const facebook::jsi::Value *,
+              size_t) {
+            benchMarked = true;
+            firstInstruction = Clock::now();
+            return facebook::jsi::Value::undefined();
+          }));
+
+  auto start = Clock::now();
+  try {
+    direct.loader->evaluateJavaScript(bundle, "startup.js");
+  } catch (const facebook::jsi::JSIException &e) {
+    fprintf(stderr, "startup.js failed: %s\n", e.what());
+    return;
+  }
+  double totalMs = elapsedMs(start);
+  if (!benchMarked)
+    return;
+
+  samples.push_back(
+      {std::chrono::duration<double, std::milli>(firstInstruction - start)
+           .count(),
+       totalMs});
+}
+
+std::unique_ptr<facebook::jsi::PreparedScriptStore> makeBenchStore(
+    std::shared_ptr<facebook::react::BufferStore> bufferStore) {
+  return std::make_unique<facebook::react::BasePreparedScriptStoreImpl>(
+      std::move(bufferStore));
+}
+
+StartupTimes median(std::vector<StartupTimes> samples) {
+  std::sort(
+      samples.begin(),
+      samples.end(),
+      [](const StartupTimes &a, const StartupTimes &b) {
+        return a.totalMs < b.totalMs;
+      });
+  return samples[samples.size() / 2];
+}
+
+// Writes the median of the samples, or null when every load failed.
+void writeStartupTimes(
+    FILE *out,
+    const char *name,
+    const std::vector<StartupTimes> &samples,
+    bool last) {
+  if (samples.empty()) {
+    fprintf(out, "      \"%s\": null%s\n", name, last ? "" : ",");
+    return;
+  }
+
+  StartupTimes times = median(samples);
+  fprintf(
+      out,
+      "      \"%s\": {\"ttfiMs\": %.3f, \"totalMs\": %.3f}%s\n",
+      name,
+      times.ttfiMs,
+      times.totalMs,
+      last ? "" : ",");
+}
+
+// Startup of a bundle through each of the loading paths:
+//  - sourceEval: no store, Hermes compiles the source on every load.
+//  - coldCompile: store miss, compiles and persists the bytecode.
+//  - warmHit: store hit, the bytecode is read into memory.
+//  - mmapHit: store hit, the bytecode is mapped.
+// Warm and mapped hits run with the store files in the OS page cache. Each
+// figure is the median of a few loads, by total time.
+void benchStartup(FILE *out) {
+  makeBenchStoreDirectory();
+
+  const size_t sizes[] = {
+      100 * 1024, 1024 * 1024, 10 * 1024 * 1024, 50 * 1024 * 1024};
+  constexpr int ITERATIONS = 3;
+
+  fprintf(out, "{\n");
+  fprintf(
+      out,
+      "  \"bytecodeVersion\": %u,\n",
+      facebook::hermes::HermesRuntime::getBytecodeVersion());
+  fprintf(out, "  \"iterations\": %d,\n", ITERATIONS);
+  fprintf(out, "  \"bundles\": [\n");
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    std::string body = "__benchMark();\n" + makeSyntheticBundle(sizes[i]);
+
+    std::vector<StartupTimes> sourceEval, coldCompile, warmHit, mmapHit;
+    std::shared_ptr<const facebook::jsi::Buffer> bundle;
+    for (int iteration = 0; iteration < ITERATIONS; iteration++) {
+      // A new salt every time, each cold load has to miss.
+      bundle = std::make_shared<StringBuffer>(saltBundle(body));
+      timeStartup(nullptr, bundle, sourceEval);
+      timeStartup(
+          makeBenchStore(
+              std::make_shared<facebook::react::LocalFileSimpleBufferStore>(
+                  BENCH_STORE_DIRECTORY)),
+          bundle,
+          coldCompile);
+    }
+
+    // All hits are on the last bundle persisted.
+    for (int iteration = 0; iteration < ITERATIONS; iteration++) {
+      timeStartup(
+          makeBenchStore(
+              std::make_shared<facebook::react::LocalFileSimpleBufferStore>(
+                  BENCH_STORE_DIRECTORY)),
+          bundle,
+          warmHit);
+      timeStartup(
+          makeBenchStore(
+              std::make_shared<facebook::react::LocalFileMappedBufferStore>(
+                  BENCH_STORE_DIRECTORY)),
+          bundle,
+          mmapHit);
+    }
+
+    fprintf(out, "    {\n");
+    fprintf(out, "      \"sizeInBytes\": %zu,\n", bundle->size());
+    writeStartupTimes(out, "sourceEval", sourceEval, false);
+    writeStartupTimes(out, "coldCompile", coldCompile, false);
+    writeStartupTimes(out, "warmHit", warmHit, false);
+    writeStartupTimes(out, "mmapHit", mmapHit, true);
+    fprintf(
+        out,
+        "    }%s\n",
+        i + 1 < sizeof(sizes) / sizeof(sizes[0]) ? "," : "");
+    fflush(out);
+  }
+
+  fprintf(out, "  ]\n}\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc == 3 && strcmp(argv[1], "--runtime-config") == 0) {
+    size_t index = static_cast<size_t>(atoi(argv[2]));
+    if (index >= sizeof(RUNTIME_CONFIGS) / sizeof(RUNTIME_CONFIGS[0]))
+      return 1;
+    runConfigWorkload(RUNTIME_CONFIGS[index]);
+    return 0;
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "--startup-json") == 0) {
+    FILE *out = argc >= 3 ? fopen(argv[2], "w") : stdout;
+    if (!out)
+      return 1;
+    benchStartup(out);
+    return out == stdout || fclose(out) == 0 ? 0 : 1;
+  }
+
+  benchHashVsCompile();
+  benchEvaluateAllocations();
+  benchJsiCallOverhead();
+  benchRuntimeConfigs(argv[0]);
+  return 0;
+}
@@ -2,11 +2,21 @@
 // execution begins and ends there.
 //
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <thread>
+#include <unordered_set>
 
 #include <sstream>
 
+#include <jsi/ScriptHash.h>
 #include <jsi/ScriptStore.h>
 #include <jsi/decorator.h>
 
@@ -17,6 +27,7 @@
 #include <hermes/inspector/RuntimeAdapter.h>
 #include <hermes/inspector/chrome/Connection.h>
 
+#include "hermesw.h"
 #include "transport/ws_session.h"
 
 using namespace facebook;
@@ -111,6 +122,42 @@ void dumpDynamic(const folly::dynamic &dyn) {
   indent--;
 }
 
+// Prepared scripts are only interchangeable between runtimes which agree on
+// the bytecode format, so that is what we use as the runtime version.
+jsi::JSRuntimeSignature getHermesRuntimeSignature() {
+  return {"Hermes", facebook::hermes::HermesRuntime::getBytecodeVersion()};
+}
+
+// Tag under which the debug runtime keeps the sources of the scripts it ran in
+// the prepared script store, next to their bytecode. Only the debugger reads
+// them, and only for the scripts it shows. The bytecode itself is not touched:
+// compileJS already builds it without debug info, keeping only the locations
+// of the instructions that can throw, which the stack traces need.
+constexpr const char *DEBUG_SOURCE_TAG = "debug-source";
+
+// The inspector server lives as long as some debug runtime uses it.
+std::shared_ptr<web_socket_server_interface> getInspectorServer(
+    const HermesRuntimeConfig &config) {
+  static std::mutex mutex;
+  static std::weak_ptr<web_socket_server_interface> shared_server;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto server = shared_server.lock();
+  if (!server) {
+    // Paused call stacks and script sources are large JSON messages, which
+    // compress well. That counts when debugging a remote host.
+    web_socket_options options;
+    options.deflate = true;
+
+    server = create_shared_web_socket_server(
+        config.inspectorPort, config.inspectorThreadCount, options);
+    shared_server = server;
+  }
+  return server;
+}
+
+std::atomic<uint64_t> g_next_debug_target_id{1};
+
 class DebugHermesRuntime : public facebook::jsi::RuntimeDecorator<
                                facebook::hermes::HermesRuntime,
                                facebook::jsi::Runtime> {
@@ -136,17 +183,21 @@ class DebugHermesRuntime : public facebook::jsi::RuntimeDecorator<
         assert(scriptId.isString());
         assert(url.isString());
 
+        std::lock_guard<std::mutex> lock(runtime_.sources_mutex_);
         runtime_.script_id_url_map_.emplace(scriptId.asInt(), url.getString());
       }
 
-      ws_connection_->write(message);
+      ws_connection_->write(std::move(message));
     }
 
-    void onDisconnect() override {}
+    // Also called when the session ended first, closing it again is harmless.
+    void onDisconnect() override {
+      ws_connection_->close();
+    }
   };
 
-  void sendMessageToVM(const std::string &line) {
-    conn_->sendMessage(line);
+  void sendMessageToVM(std::string line) {
+    conn_->sendMessage(std::move(line));
   }
 
   void sendMessageToDebuggerClient(
@@ -158,6 +209,11 @@ class DebugHermesRuntime : public facebook::jsi::RuntimeDecorator<
   bool handleScriptSourceRequest(
       const std::string &reqStr,
       web_socket_session_interface &ws_connection) {
+    // Spares parsing every other message, they go to the VM as they are.
+    if (reqStr.find("Debugger.getScriptSource") == std::string::npos) {
+      return false;
+    }
+
     auto req = folly::parseJson(reqStr);
 
     if (req.at("method") == "Debugger.getScriptSource") {
@@ -170,12 +226,19 @@ class DebugHermesRuntime : public facebook::jsi::RuntimeDecorator<
       assert(scriptId.isString());
 
 	  result["scriptSource"] = "<Unable to fetch source>";
-      if (script_id_url_map_.find(scriptId.asInt()) !=
-          script_id_url_map_.end()) {
-        std::string url = script_id_url_map_[scriptId.asInt()];
-        if (url_source_map_.find(url) != url_source_map_.end()) {
-          result["scriptSource"] = url_source_map_[url];
-        } else {
+      std::string url;
+      {
+        std::lock_guard<std::mutex> lock(sources_mutex_);
+        auto it = script_id_url_map_.find(scriptId.asInt());
+        if (it != script_id_url_map_.end())
+          url = it->second;
+      }
+      if (!url.empty()) {
+        std::shared_ptr<const jsi::Buffer> source = getScriptSource(url);
+        if (source) {
+          // Only materialized when the debugger asks for it.
+          result["scriptSource"] = std::string(
+              reinterpret_cast<const char *>(source->data()), source->size());
         }
       }
 
@@ -191,28 +254,68 @@ class DebugHermesRuntime : public facebook::jsi::RuntimeDecorator<
     return false;
   }
 
-  void runDebuggerLoop_ws(
-      facebook::hermes::inspector::chrome::Connection &conn) {
-    create_web_socket_server(
-        8888,
+  std::shared_ptr<const jsi::Buffer> getScriptSource(const std::string &url) {
+    jsi::ScriptSignature signature;
+    {
+      std::lock_guard<std::mutex> lock(sources_mutex_);
+      auto source = url_source_map_.find(url);
+      if (source != url_source_map_.end()) {
+        return source->second;
+      }
+
+      auto it = url_signature_map_.find(url);
+      if (it == url_signature_map_.end()) {
+        return nullptr;
+      }
+      signature = it->second;
+    }
+
+    // The read goes to disk, evaluation and scriptParsed needn't wait for it.
+    return prepared_script_store_->tryGetPreparedScript(
+        signature, getHermesRuntimeSignature(), DEBUG_SOURCE_TAG);
+  }
+
+  // The runtime is a target of the shared inspector server, at
+  // /devtools/page/<target_id_>.
+  void addInspectorTarget(const HermesRuntimeConfig &config) {
+    inspector_server_ = getInspectorServer(config);
+    if (!inspector_server_)
+      return;
+
+    target_id_ = std::to_string(g_next_debug_target_id++);
+    inspector_server_->add_target(
+        target_id_,
+        "Hermes runtime " + target_id_,
         [this](std::shared_ptr<web_socket_session_interface> ws_connection) {
-          conn_->connect(
-              std::make_unique<RemoteConnection>(ws_connection, *this));
+          // The runtime takes one debugger at a time.
+          if (!conn_->connect(
+                  std::make_unique<RemoteConnection>(ws_connection, *this))) {
+            ws_connection->close();
+            return;
+          }
 
           ws_connection->setOnRead([this, ws_connection](std::string line) {
             if (!handleScriptSourceRequest(line, *ws_connection)) {
-              sendMessageToVM(line);
+              sendMessageToVM(std::move(line));
             }
           });
+
+          // Lets the next debugger attach.
+          ws_connection->setOnClose([this]() { conn_->disconnect(); });
         });
   }
 
  public:
-  DebugHermesRuntime(std::unique_ptr<facebook::hermes::HermesRuntime> base)
+  DebugHermesRuntime(
+      std::unique_ptr<facebook::hermes::HermesRuntime> base,
+      std::unique_ptr<facebook::jsi::PreparedScriptStore> prepared_script_store,
+      const HermesRuntimeConfig &config)
       : facebook::jsi::RuntimeDecorator<
             facebook::hermes::HermesRuntime,
             facebook::jsi::Runtime>(*base),
-        base_(std::move(base)) {
+        base_(std::move(base)),
+        prepared_script_store_(std::move(prepared_script_store)),
+        lazy_compilation_(config.lazyCompilation) {
     base_->getDebugger().setShouldPauseOnScriptLoad(true);
 
     auto adapter =
@@ -222,109 +325,1204 @@ class DebugHermesRuntime : public facebook::jsi::RuntimeDecorator<
     conn_ = std::make_unique<facebook::hermes::inspector::chrome::Connection>(
         std::move(adapter), "hermes-chrome-debug-server");
 
-    debugger_thread_ = std::thread(
-        &DebugHermesRuntime::runDebuggerLoop_ws, this, std::ref(*conn_));
+    addInspectorTarget(config);
+  }
+
+  ~DebugHermesRuntime() {
+    // Waits for the sessions to let go of the runtime.
+    if (inspector_server_)
+      inspector_server_->remove_target(target_id_);
+
+    // The connection may still call into RemoteConnection until it is gone,
+    // which uses the members below, destroyed before it otherwise.
+    conn_.reset();
+
+    // Sources not written yet are written first, so that the next run finds
+    // them in the store.
+    {
+      std::lock_guard<std::mutex> lock(sources_mutex_);
+      stopping_ = true;
+    }
+    sources_cv_.notify_one();
+    if (source_writer_.joinable())
+      source_writer_.join();
   }
 
   jsi::Value evaluateJavaScript(
       const std::shared_ptr<const jsi::Buffer> &source,
       const std::string &sourceURL) override {
     facebook::hermes::HermesRuntime::DebugFlags flags;
-    std::string source_str(
-        reinterpret_cast<const char *>(source->data()), source->size());
+    flags.lazy = lazy_compilation_;
 
-    url_source_map_.emplace(sourceURL, source_str);
+    storeScriptSource(source, sourceURL);
 
-    base_->debugJavaScript(source_str, sourceURL, flags);
+    // debugJavaScript only takes a std::string, this is the one copy left.
+    base_->debugJavaScript(
+        std::string(
+            reinterpret_cast<const char *>(source->data()), source->size()),
+        sourceURL,
+        flags);
 
     return jsi::Value::undefined();
   }
 
  private:
+  // Keeps the source around for getScriptSource. With a prepared script store
+  // the source goes to the store and only its signature is kept in memory, so
+  // that the sources of a large app don't stay resident for the whole session.
+  // The store is written by source_writer_, the caller's buffer is kept until
+  // then.
+  void storeScriptSource(
+      const std::shared_ptr<const jsi::Buffer> &source,
+      const std::string &sourceURL) {
+    // Keep the caller's buffer rather than a copy.
+    if (!prepared_script_store_) {
+      std::lock_guard<std::mutex> lock(sources_mutex_);
+      url_source_map_[sourceURL] = source;
+      return;
+    }
+
+    jsi::ScriptSignature signature = {
+        sourceURL, jsi::computeScriptVersion(*source), true};
+
+    std::lock_guard<std::mutex> lock(sources_mutex_);
+    url_source_map_[sourceURL] = source;
+    url_signature_map_[sourceURL] = signature;
+    pending_sources_.push_back({std::move(signature), source});
+    if (!source_writer_.joinable())
+      source_writer_ = std::thread(&DebugHermesRuntime::writeSources, this);
+    sources_cv_.notify_one();
+  }
+
+  // Runs on source_writer_. A source the store has already, e.g. from an
+  // earlier run, isn't written again. It is only dropped from memory once the
+  // store hands it back, so a failed write costs memory rather than the source.
+  void writeSources() {
+    std::unique_lock<std::mutex> lock(sources_mutex_);
+    while (true) {
+      sources_cv_.wait(
+          lock, [this] { return stopping_ || !pending_sources_.empty(); });
+      if (pending_sources_.empty())
+        return;
+
+      PendingSource pending = std::move(pending_sources_.front());
+      pending_sources_.pop_front();
+      lock.unlock();
+
+      jsi::JSRuntimeSignature runtime_signature = getHermesRuntimeSignature();
+      bool stored = prepared_script_store_->tryGetPreparedScript(
+                        pending.signature,
+                        runtime_signature,
+                        DEBUG_SOURCE_TAG) != nullptr;
+      if (!stored) {
+        prepared_script_store_->persistPreparedScript(
+            pending.source,
+            pending.signature,
+            runtime_signature,
+            DEBUG_SOURCE_TAG);
+        stored = prepared_script_store_->tryGetPreparedScript(
+                     pending.signature,
+                     runtime_signature,
+                     DEBUG_SOURCE_TAG) != nullptr;
+      }
+
+      lock.lock();
+      auto source = url_source_map_.find(pending.signature.url);
+      if (stored && source != url_source_map_.end() &&
+          source->second == pending.source) {
+        url_source_map_.erase(source);
+      }
+    }
+  }
+
   friend class RemoteConnection;
   std::shared_ptr<facebook::hermes::HermesRuntime> base_;
+  std::unique_ptr<facebook::jsi::PreparedScriptStore> prepared_script_store_;
+  bool lazy_compilation_;
 
   // TODO :: Think harder on the lifetime and disconnection	.
   std::unique_ptr<facebook::hermes::inspector::chrome::Connection> conn_;
 
-  std::thread debugger_thread_;
+  std::shared_ptr<web_socket_server_interface> inspector_server_;
+  std::string target_id_;
 
+  // Evaluation runs on the JS thread, the inspector on its own and
+  // getScriptSource on the server's. Everything below is guarded by
+  // sources_mutex_, bar source_writer_ itself.
+  std::mutex sources_mutex_;
   std::unordered_map<int, std::string> script_id_url_map_;
-  std::unordered_map<std::string, std::string> url_source_map_;
+  std::unordered_map<std::string, std::shared_ptr<const jsi::Buffer>>
+      url_source_map_;
+  std::unordered_map<std::string, jsi::ScriptSignature> url_signature_map_;
+
+  struct PendingSource {
+    jsi::ScriptSignature signature;
+    std::shared_ptr<const jsi::Buffer> source;
+  };
+  std::deque<PendingSource> pending_sources_;
+  std::condition_variable sources_cv_;
+  bool stopping_{false};
+  std::thread source_writer_;
 };
 
-// Note:: Unfortunately, we can't override from the concrete implementation
-// which is HermesRuntimeImpl, which has perf implications due to multiple
-// virtual pointer chases!
-class DynamicPreparedScriptHermesRuntime
-    : public facebook::jsi::RuntimeDecorator<
-          facebook::hermes::HermesRuntime,
-          facebook::jsi::Runtime> {
+std::unique_ptr<facebook::hermes::HermesRuntime> makeConfiguredHermesRuntime(
+    const HermesRuntimeConfig &config) {
+  ::hermes::vm::GCConfig::Builder gc_config;
+  if (config.initHeapSize)
+    gc_config.withInitHeapSize(config.initHeapSize);
+  if (config.maxHeapSize)
+    gc_config.withMaxHeapSize(config.maxHeapSize);
+
+  ::hermes::vm::RuntimeConfig::Builder runtime_config;
+  runtime_config.withGCConfig(gc_config.build());
+  if (config.maxNumRegisters)
+    runtime_config.withMaxNumRegisters(config.maxNumRegisters);
+
+  return facebook::hermes::makeHermesRuntime(runtime_config.build());
+}
+
+// Ways of preparing a script, each persisted under a tag of its own. The first
+// one is the default; "perf" is what the optimized bytecode has always been
+// persisted under.
+struct PrepareVariant {
+  const char *tag;
+  bool optimize;
+};
+
+constexpr PrepareVariant PREPARE_VARIANTS[] = {
+    {"perf", true},
+    // Cheaper to compile, for scripts the optimizer doesn't pay off for.
+    {"fast-compile", false},
+};
+
+constexpr size_t PREPARE_VARIANT_COUNT =
+    sizeof(PREPARE_VARIANTS) / sizeof(PREPARE_VARIANTS[0]);
+
+// Tag under which the measured evaluation times of the variants are kept.
+constexpr const char *PREPARE_TIMINGS_TAG = "timings";
+constexpr uint32_t PREPARE_TIMINGS_FORMAT_VERSION = 1;
+// Loads timed per variant before the measured policy settles on one.
+constexpr uint32_t PREPARE_TIMINGS_MIN_SAMPLES = 3;
+// Scripts whose timings are kept in memory.
+constexpr size_t PREPARE_TIMINGS_MAX_SCRIPTS = 1024;
+
+// How long a synchronous load waits for a script being prepared elsewhere,
+// before it evaluates the source instead, and how often it checks.
+constexpr std::chrono::milliseconds PREPARE_CLAIM_WAIT{100};
+constexpr std::chrono::milliseconds PREPARE_CLAIM_POLL_INTERVAL{10};
+
+struct PreparedScriptCounters {
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> compiles_in_flight{0};
+  std::atomic<uint64_t> compiles_completed{0};
+  std::atomic<uint64_t> compiles_dropped{0};
+  std::atomic<uint64_t> version_mismatches{0};
+  std::atomic<uint64_t> compiles_deferred{0};
+};
+
+PreparedScriptCounters g_prepared_script_counters;
+
+// Leading fields of the Hermes bytecode file header (BytecodeFileHeader in
+// hermes/BCGen/HBC/BytecodeFileFormat.h). These two are laid out the same in
+// every bytecode version.
+struct HbcFileHeaderPrefix {
+  uint64_t magic;
+  uint32_t version;
+};
+
+// Whether the linked Hermes can load the bytecode. The store only guarantees
+// that the buffer is what was persisted, and a prepared script can survive a
+// Hermes upgrade, in which case the VM refuses it at load time.
+bool isLoadableHermesBytecode(const jsi::Buffer &buffer) {
+  if (buffer.size() < sizeof(HbcFileHeaderPrefix) ||
+      !facebook::hermes::HermesRuntime::isHermesBytecode(
+          buffer.data(), buffer.size())) {
+    return false;
+  }
+
+  uint32_t version;
+  memcpy(
+      &version,
+      buffer.data() + offsetof(HbcFileHeaderPrefix, version),
+      sizeof(version));
+  return version == facebook::hermes::HermesRuntime::getBytecodeVersion();
+}
+
+// Claim on preparing a script, released on destruction at the latest. See
+// PreparedScriptStore::tryBeginPreparingScript.
+class PreparingScriptClaim {
  public:
-  DynamicPreparedScriptHermesRuntime(
-      std::unique_ptr<facebook::hermes::HermesRuntime> base,
-      std::unique_ptr<facebook::jsi::PreparedScriptStore> prepared_script_store)
-      : facebook::jsi::RuntimeDecorator<
-            facebook::hermes::HermesRuntime,
-            facebook::jsi::Runtime>(*base),
-        base_(std::move(base)),
-        prepared_script_store_(std::move(prepared_script_store)) {}
+  PreparingScriptClaim(
+      jsi::PreparedScriptStore &store,
+      const jsi::ScriptSignature &script_signature,
+      const jsi::JSRuntimeSignature &runtime_signature,
+      const char *prepare_tag)
+      : store_(store),
+        script_signature_(script_signature),
+        runtime_signature_(runtime_signature),
+        prepare_tag_(prepare_tag),
+        granted_(store.tryBeginPreparingScript(
+            script_signature,
+            runtime_signature,
+            prepare_tag)) {}
+
+  ~PreparingScriptClaim() {
+    release();
+  }
+
+  bool granted() const {
+    return granted_;
+  }
+
+  void release() {
+    if (granted_) {
+      store_.endPreparingScript(
+          script_signature_, runtime_signature_, prepare_tag_);
+      granted_ = false;
+    }
+  }
+
+ private:
+  PreparingScriptClaim(const PreparingScriptClaim &) = delete;
+  PreparingScriptClaim &operator=(const PreparingScriptClaim &) = delete;
+
+  jsi::PreparedScriptStore &store_;
+  jsi::ScriptSignature script_signature_;
+  jsi::JSRuntimeSignature runtime_signature_;
+  const char *prepare_tag_;
+  bool granted_;
+};
+
+constexpr size_t BACKGROUND_COMPILE_THREADS = 2;
+constexpr size_t BACKGROUND_COMPILE_MAX_QUEUED_JOBS = 16;
+
+// Compiles scripts to bytecode on a small pool of worker threads and persists
+// the bytecode into the prepared script store, so that the next load of the
+// script hits the store instead of blocking on the compiler. One instance is
+// shared by all the runtimes of the process while any of them is alive.
+class BackgroundScriptCompiler {
+ public:
+  struct Job {
+    std::shared_ptr<const jsi::Buffer> source;
+    std::string source_url;
+    jsi::ScriptSignature script_signature;
+    jsi::JSRuntimeSignature runtime_signature;
+    // Index into PREPARE_VARIANTS.
+    size_t variant;
+    std::shared_ptr<jsi::PreparedScriptStore> prepared_script_store;
+  };
+
+  static std::shared_ptr<BackgroundScriptCompiler> getShared() {
+    static std::mutex shared_mutex;
+    static std::weak_ptr<BackgroundScriptCompiler> shared;
+
+    std::lock_guard<std::mutex> lock(shared_mutex);
+    auto compiler = shared.lock();
+    if (!compiler) {
+      compiler = std::make_shared<BackgroundScriptCompiler>(
+          BACKGROUND_COMPILE_THREADS, BACKGROUND_COMPILE_MAX_QUEUED_JOBS);
+      shared = compiler;
+    }
+    return compiler;
+  }
+
+  BackgroundScriptCompiler(size_t thread_count, size_t max_queued_jobs)
+      : max_queued_jobs_(max_queued_jobs) {
+    for (size_t i = 0; i < thread_count; i++) {
+      workers_.emplace_back(&BackgroundScriptCompiler::workerLoop, this);
+    }
+  }
+
+  // Jobs still in the queue are dropped. They will be requeued by the next
+  // load of the script. Jobs not past their claim are cancelled, but compiles
+  // already running are waited for, so this blocks for as long as the
+  // compilation of the largest script in flight, if any. It runs with the last
+  // runtime to let go of the compiler.
+  ~BackgroundScriptCompiler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      g_prepared_script_counters.compiles_in_flight -= queue_.size();
+      queue_.clear();
+    }
+    cv_.notify_all();
+
+    for (std::thread &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Returns false when the job is not queued, either because the same url is
+  // already being compiled or because the queue is full.
+  bool enqueue(Job job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (in_flight_urls_.count(job.source_url)) {
+        return false;
+      }
+
+      if (queue_.size() >= max_queued_jobs_) {
+        g_prepared_script_counters.compiles_dropped++;
+        return false;
+      }
+
+      in_flight_urls_.insert(job.source_url);
+      queue_.push_back(std::move(job));
+      g_prepared_script_counters.compiles_in_flight++;
+    }
+    cv_.notify_one();
+    return true;
+  }
+
+ private:
+  void workerLoop() {
+    while (true) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (stopping_) {
+        return;
+      }
+
+      Job job = std::move(queue_.front());
+      queue_.pop_front();
+      lock.unlock();
+
+      compileAndPersist(job);
+
+      lock.lock();
+      in_flight_urls_.erase(job.source_url);
+      g_prepared_script_counters.compiles_in_flight--;
+      g_prepared_script_counters.compiles_completed++;
+    }
+  }
+
+  void compileAndPersist(const Job &job) {
+    const PrepareVariant &variant = PREPARE_VARIANTS[job.variant];
+
+    // Leave the script to whoever, in this or another process, is already
+    // preparing it.
+    PreparingScriptClaim claim(
+        *job.prepared_script_store,
+        job.script_signature,
+        job.runtime_signature,
+        variant.tag);
+    if (!claim.granted()) {
+      g_prepared_script_counters.compiles_deferred++;
+      return;
+    }
+
+    // Or has prepared it since the load which queued the job.
+    std::shared_ptr<const jsi::Buffer> existing =
+        job.prepared_script_store->tryGetPreparedScript(
+            job.script_signature, job.runtime_signature, variant.tag);
+    if (existing && isLoadableHermesBytecode(*existing)) {
+      return;
+    }
+
+    // compileJS can't be interrupted, the last chance to give up.
+    if (stopping_) {
+      return;
+    }
+
+    std::string source_str(
+        reinterpret_cast<const char *>(job.source->data()),
+        job.source->size());
+    std::string hbc_compiled;
+    ::hermes::compileJS(
+        source_str, job.source_url, hbc_compiled, variant.optimize);
+    if (!hbc_compiled.empty()) {
+      job.prepared_script_store->persistPreparedScript(
+          StringBuffer::bufferFromString(std::move(hbc_compiled)),
+          job.script_signature,
+          job.runtime_signature,
+          variant.tag);
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job> queue_;
+  std::unordered_set<std::string> in_flight_urls_;
+  size_t max_queued_jobs_;
+  // Set under mutex_, but also read without it by the compiles in flight.
+  std::atomic<bool> stopping_{false};
+
+  std::vector<std::thread> workers_;
+};
+
+// Picks the variant scripts are prepared as under
+// PreparedScriptVariantPolicy::Measured. Every variant is tried on a few loads
+// of the script, timing the evaluation of its bytecode, after which the
+// fastest one sticks. The timings are kept in memory, and in the prepared
+// script store next to the bytecode so that they add up across runs. They are
+// written once the script settles, or when the loader which timed them goes
+// away, rather than after every load.
+class PrepareVariantSelector {
+ public:
+  static PrepareVariantSelector &get() {
+    static PrepareVariantSelector selector;
+    return selector;
+  }
+
+  size_t select(
+      jsi::PreparedScriptStore &store,
+      const jsi::ScriptSignature &script_signature,
+      const jsi::JSRuntimeSignature &runtime_signature) {
+    std::string key = getKey(script_signature, runtime_signature);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto entry = entries_.find(key);
+      if (entry != entries_.end()) {
+        return nextVariant(entry->second);
+      }
+    }
+
+    // First time this process sees the script, pick up where the previous
+    // runs left off.
+    Timings timings = load(store, script_signature, runtime_signature);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = entries_.find(key);
+    if (entry == entries_.end()) {
+      makeRoom();
+      entry = entries_
+                  .emplace(
+                      key,
+                      Entry{
+                          script_signature,
+                          runtime_signature,
+                          timings,
+                          false,
+                          0,
+                          nullptr})
+                  .first;
+    }
+    return nextVariant(entry->second);
+  }
+
+  void record(
+      jsi::PreparedScriptStore &store,
+      const jsi::ScriptSignature &script_signature,
+      const jsi::JSRuntimeSignature &runtime_signature,
+      size_t variant,
+      uint64_t elapsed_ns) {
+    Timings timings;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // select made the entry, unless it got dropped since.
+      auto it = entries_.find(getKey(script_signature, runtime_signature));
+      if (it == entries_.end() || it->second.settled) {
+        return;
+      }
+
+      Entry &entry = it->second;
+      uint32_t samples = ++entry.timings.samples[variant];
+      int64_t delta = static_cast<int64_t>(elapsed_ns) -
+          static_cast<int64_t>(entry.timings.average_ns[variant]);
+      entry.timings.average_ns[variant] +=
+          delta / static_cast<int64_t>(samples);
+      entry.dirty_store = &store;
+
+      nextVariant(entry);
+      if (!entry.settled) {
+        return;
+      }
+
+      entry.dirty_store = nullptr;
+      timings = entry.timings;
+    }
+
+    persist(store, script_signature, runtime_signature, timings);
+  }
+
+  // Persists the timings recorded through the store, which is going away.
+  void flush(jsi::PreparedScriptStore &store) {
+    std::vector<Entry> dirty;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto &entry : entries_) {
+        if (entry.second.dirty_store == &store) {
+          dirty.push_back(entry.second);
+          entry.second.dirty_store = nullptr;
+        }
+      }
+    }
+
+    for (const Entry &entry : dirty) {
+      persist(
+          store,
+          entry.script_signature,
+          entry.runtime_signature,
+          entry.timings);
+    }
+  }
+
+ private:
+  struct Timings {
+    uint32_t samples[PREPARE_VARIANT_COUNT];
+    uint64_t average_ns[PREPARE_VARIANT_COUNT];
+  };
+
+  struct Entry {
+    jsi::ScriptSignature script_signature;
+    jsi::JSRuntimeSignature runtime_signature;
+    Timings timings;
+    bool settled;
+    size_t best;
+    // Store the samples not persisted yet were recorded through, if any.
+    jsi::PreparedScriptStore *dirty_store;
+  };
+
+  // The timings only hold for the bytecode of one Hermes version.
+  static std::string getKey(
+      const jsi::ScriptSignature &script_signature,
+      const jsi::JSRuntimeSignature &runtime_signature) {
+    std::string key = std::to_string(script_signature.version) + "_" +
+        std::to_string(runtime_signature.version);
+    if (!script_signature.contentVersion) {
+      key += "_" + script_signature.url;
+    }
+    return key;
+  }
+
+  // Settles the entry once every variant has been timed enough.
+  static size_t nextVariant(Entry &entry) {
+    if (entry.settled) {
+      return entry.best;
+    }
+
+    size_t best = 0;
+    for (size_t variant = 0; variant < PREPARE_VARIANT_COUNT; variant++) {
+      if (entry.timings.samples[variant] < PREPARE_TIMINGS_MIN_SAMPLES) {
+        return variant;
+      }
+      if (entry.timings.average_ns[variant] <
+          entry.timings.average_ns[best]) {
+        best = variant;
+      }
+    }
+
+    entry.settled = true;
+    entry.best = best;
+    return best;
+  }
+
+  // Caller must hold mutex_. Drops an entry, which is reloaded from the store
+  // if needed again, preferring ones with nothing left to persist.
+  void makeRoom() {
+    if (entries_.size() < PREPARE_TIMINGS_MAX_SCRIPTS) {
+      return;
+    }
+
+    auto victim = std::find_if(
+        entries_.begin(), entries_.end(), [](const auto &entry) {
+          return !entry.second.dirty_store;
+        });
+    // Losing samples only prolongs the exploration.
+    entries_.erase(victim != entries_.end() ? victim : entries_.begin());
+  }
+
+  // Stored as little endian
+  //   uint32_t format_version
+  //   uint32_t samples[PREPARE_VARIANT_COUNT]
+  //   uint64_t average_ns[PREPARE_VARIANT_COUNT]
+  static constexpr size_t TIMINGS_SIZE = 4 + PREPARE_VARIANT_COUNT * (4 + 8);
+
+  static void appendLittleEndian(std::string &out, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) {
+      out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+  }
+
+  static uint64_t readLittleEndian(const uint8_t *&in, int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++) {
+      value |= static_cast<uint64_t>(*in++) << (8 * i);
+    }
+    return value;
+  }
+
+  static Timings load(
+      jsi::PreparedScriptStore &store,
+      const jsi::ScriptSignature &script_signature,
+      const jsi::JSRuntimeSignature &runtime_signature) {
+    Timings timings = {};
+
+    std::shared_ptr<const jsi::Buffer> buffer = store.tryGetPreparedScript(
+        script_signature, runtime_signature, PREPARE_TIMINGS_TAG);
+    if (!buffer || buffer->size() != TIMINGS_SIZE) {
+      return timings;
+    }
+
+    const uint8_t *in = buffer->data();
+    if (readLittleEndian(in, 4) != PREPARE_TIMINGS_FORMAT_VERSION) {
+      return timings;
+    }
+    for (size_t variant = 0; variant < PREPARE_VARIANT_COUNT; variant++) {
+      timings.samples[variant] = static_cast<uint32_t>(readLittleEndian(in, 4));
+    }
+    for (size_t variant = 0; variant < PREPARE_VARIANT_COUNT; variant++) {
+      timings.average_ns[variant] = readLittleEndian(in, 8);
+    }
+    return timings;
+  }
+
+  static void persist(
+      jsi::PreparedScriptStore &store,
+      const jsi::ScriptSignature &script_signature,
+      const jsi::JSRuntimeSignature &runtime_signature,
+      const Timings &timings) {
+    std::string out;
+    out.reserve(TIMINGS_SIZE);
+    appendLittleEndian(out, PREPARE_TIMINGS_FORMAT_VERSION, 4);
+    for (size_t variant = 0; variant < PREPARE_VARIANT_COUNT; variant++) {
+      appendLittleEndian(out, timings.samples[variant], 4);
+    }
+    for (size_t variant = 0; variant < PREPARE_VARIANT_COUNT; variant++) {
+      appendLittleEndian(out, timings.average_ns[variant], 8);
+    }
+
+    store.persistPreparedScript(
+        StringBuffer::bufferFromString(std::move(out)),
+        script_signature,
+        runtime_signature,
+        PREPARE_TIMINGS_TAG);
+  }
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+// Evaluates scripts through the prepared script store. Used by the
+// DynamicPreparedScriptHermesRuntime decorator as well as on its own, by
+// makeDirectPreparedScriptHermesRuntime.
+class PreparedScriptLoaderImpl : public PreparedScriptLoader {
+ public:
+  PreparedScriptLoaderImpl(
+      facebook::jsi::Runtime &runtime,
+      std::unique_ptr<facebook::jsi::ScriptStore> script_store,
+      std::unique_ptr<facebook::jsi::PreparedScriptStore> prepared_script_store,
+      PreparedScriptCompileMode compile_mode,
+      PreparedScriptVariantPolicy variant_policy)
+      : runtime_(runtime),
+        script_store_(std::move(script_store)),
+        prepared_script_store_(std::move(prepared_script_store)),
+        variant_policy_(variant_policy) {
+    if (prepared_script_store_) {
+      // Stores only act on the first call, later runtimes pay nothing.
+      prepared_script_store_->prefetchPreparedScripts();
+    }
+
+    if (prepared_script_store_ &&
+        compile_mode == PreparedScriptCompileMode::Background) {
+      background_compiler_ = BackgroundScriptCompiler::getShared();
+    }
+  }
+
+  ~PreparedScriptLoaderImpl() {
+    if (prepared_script_store_ &&
+        variant_policy_ == PreparedScriptVariantPolicy::Measured) {
+      PrepareVariantSelector::get().flush(*prepared_script_store_);
+    }
+  }
 
   jsi::Value evaluateJavaScript(
       const std::shared_ptr<const jsi::Buffer> &source,
       const std::string &sourceURL) override {
-    jsi::ScriptSignature scriptSignature = {sourceURL, 1};
-    jsi::JSRuntimeSignature runtimeSignature = {"Hermes", 21};
-
     if (!prepared_script_store_ ||
         facebook::hermes::HermesRuntime::isHermesBytecode(
             source->data(), source->size())) {
-      return base_->evaluateJavaScript(source, sourceURL);
+      return runtime_.evaluateJavaScript(source, sourceURL);
+    }
+
+    // Key the prepared script on the content so that edits are always picked
+    // up and identical bundles served from different urls share the bytecode.
+    jsi::ScriptSignature scriptSignature = {
+        sourceURL, jsi::computeScriptVersion(*source), true};
+    jsi::JSRuntimeSignature runtimeSignature = getHermesRuntimeSignature();
+    size_t variant = selectVariant(scriptSignature, runtimeSignature);
+
+    std::shared_ptr<const jsi::Buffer> hbc_deser =
+        tryGetPreparedScript(scriptSignature, runtimeSignature, variant);
+    if (hbc_deser) {
+      return evaluatePreparedScript(
+          hbc_deser, scriptSignature, runtimeSignature, variant);
+    }
+
+    return prepareAndEvaluate(
+        source, sourceURL, scriptSignature, runtimeSignature, variant);
+  }
+
+  jsi::Value evaluateJavaScriptFromScriptStore(
+      const std::string &url) override {
+    if (!script_store_) {
+      throw jsi::JSINativeException(
+          "Runtime has no script store to load " + url + " from");
+    }
+
+    jsi::JSRuntimeSignature runtimeSignature = getHermesRuntimeSignature();
+
+    // The version is all it takes to find the prepared script, the source is
+    // only needed if there is none.
+    jsi::ScriptVersion_t version = script_store_->getScriptVersion(url);
+    bool contentVersion = script_store_->hasContentVersions();
+    if (prepared_script_store_ && version != 0) {
+      jsi::ScriptSignature scriptSignature = {url, version, contentVersion};
+      size_t variant = selectVariant(scriptSignature, runtimeSignature);
+      std::shared_ptr<const jsi::Buffer> hbc_deser =
+          tryGetPreparedScript(scriptSignature, runtimeSignature, variant);
+      if (hbc_deser) {
+        return evaluatePreparedScript(
+            hbc_deser, scriptSignature, runtimeSignature, variant);
+      }
+    }
+
+    jsi::VersionedBuffer script = script_store_->getVersionedScript(url);
+    if (!script.buffer) {
+      throw jsi::JSINativeException("Failed to load " + url);
+    }
+
+    if (!prepared_script_store_ ||
+        facebook::hermes::HermesRuntime::isHermesBytecode(
+            script.buffer->data(), script.buffer->size())) {
+      return runtime_.evaluateJavaScript(script.buffer, url);
+    }
+
+    if (script.version == 0) {
+      script.version = jsi::computeScriptVersion(*script.buffer);
+      contentVersion = true;
+    }
+
+    jsi::ScriptSignature scriptSignature = {
+        url, script.version, contentVersion};
+    size_t variant = selectVariant(scriptSignature, runtimeSignature);
+
+    if (script.version != version) {
+      // The script changed in between the two calls.
+      std::shared_ptr<const jsi::Buffer> hbc_deser =
+          tryGetPreparedScript(scriptSignature, runtimeSignature, variant);
+      if (hbc_deser) {
+        return evaluatePreparedScript(
+            hbc_deser, scriptSignature, runtimeSignature, variant);
+      }
+    }
+
+    return prepareAndEvaluate(
+        script.buffer, url, scriptSignature, runtimeSignature, variant);
+  }
+
+ private:
+  size_t selectVariant(
+      const jsi::ScriptSignature &scriptSignature,
+      const jsi::JSRuntimeSignature &runtimeSignature) {
+    if (variant_policy_ != PreparedScriptVariantPolicy::Measured) {
+      return 0;
     }
 
+    return PrepareVariantSelector::get().select(
+        *prepared_script_store_, scriptSignature, runtimeSignature);
+  }
+
+  // Returns the prepared script if there is one the VM can load. Counts hits
+  // but not misses, which are counted when the script is prepared.
+  std::shared_ptr<const jsi::Buffer> tryGetPreparedScript(
+      const jsi::ScriptSignature &scriptSignature,
+      const jsi::JSRuntimeSignature &runtimeSignature,
+      size_t variant) {
     std::shared_ptr<const jsi::Buffer> hbc_deser =
         prepared_script_store_->tryGetPreparedScript(
-            scriptSignature, runtimeSignature, "perf");
+            scriptSignature, runtimeSignature, PREPARE_VARIANTS[variant].tag);
+
+    if (hbc_deser) {
+      if (isLoadableHermesBytecode(*hbc_deser)) {
+        g_prepared_script_counters.hits++;
+        return hbc_deser;
+      }
 
+      // Handing it to the VM would only fail the load. Treat it as a miss, the
+      // recompiled bytecode replaces it in the store.
+      g_prepared_script_counters.version_mismatches++;
+    }
+
+    return nullptr;
+  }
+
+  jsi::Value evaluatePreparedScript(
+      const std::shared_ptr<const jsi::Buffer> &hbc,
+      const jsi::ScriptSignature &scriptSignature,
+      const jsi::JSRuntimeSignature &runtimeSignature,
+      size_t variant) {
+    if (variant_policy_ != PreparedScriptVariantPolicy::Measured) {
+      return runtime_.evaluateJavaScript(hbc, scriptSignature.url);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    jsi::Value result = runtime_.evaluateJavaScript(hbc, scriptSignature.url);
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    PrepareVariantSelector::get().record(
+        *prepared_script_store_,
+        scriptSignature,
+        runtimeSignature,
+        variant,
+        static_cast<uint64_t>(elapsed.count()));
+    return result;
+  }
+
+  jsi::Value prepareAndEvaluate(
+      const std::shared_ptr<const jsi::Buffer> &source,
+      const std::string &sourceURL,
+      const jsi::ScriptSignature &scriptSignature,
+      const jsi::JSRuntimeSignature &runtimeSignature,
+      size_t variant) {
+    g_prepared_script_counters.misses++;
+
+    if (background_compiler_) {
+      // Don't hold up the first execution on the compiler. Hermes runs the
+      // source directly and the bytecode will be ready for the next load.
+      background_compiler_->enqueue({source,
+                                     sourceURL,
+                                     scriptSignature,
+                                     runtimeSignature,
+                                     variant,
+                                     prepared_script_store_});
+      return runtime_.evaluateJavaScript(source, sourceURL);
+    }
+
+    PreparingScriptClaim claim(
+        *prepared_script_store_,
+        scriptSignature,
+        runtimeSignature,
+        PREPARE_VARIANTS[variant].tag);
+    if (!claim.granted()) {
+      // Someone else, typically another process sharing the store, is
+      // compiling the script. Rather than compiling it once more, give them a
+      // moment and run the source if that's not enough.
+      g_prepared_script_counters.compiles_deferred++;
+      std::shared_ptr<const jsi::Buffer> hbc_deser =
+          waitForPreparedScript(scriptSignature, runtimeSignature, variant);
+      if (hbc_deser) {
+        return evaluatePreparedScript(
+            hbc_deser, scriptSignature, runtimeSignature, variant);
+      }
+      return runtime_.evaluateJavaScript(source, sourceURL);
+    }
+
+    // It may have been persisted in between our lookup and the claim.
+    std::shared_ptr<const jsi::Buffer> hbc_deser =
+        tryGetPreparedScript(scriptSignature, runtimeSignature, variant);
     if (hbc_deser) {
-      jsi::Value result = base_->evaluateJavaScript(hbc_deser, sourceURL);
-      // TODO :: Check whether the evaluation failed to load the hbc due to
-      // version mismatch. If so, regenerate bytecode and retry.
-      return result;
+      claim.release();
+      return evaluatePreparedScript(
+          hbc_deser, scriptSignature, runtimeSignature, variant);
     }
 
+    // compileJS only takes a std::string, the source has to be copied once.
     std::string source_str(
         reinterpret_cast<const char *>(source->data()), source->size());
     std::string hbc_compiled;
 
-    bool compile_result =
-        ::hermes::compileJS(source_str, sourceURL, hbc_compiled);
+    bool compile_result = ::hermes::compileJS(
+        source_str,
+        sourceURL,
+        hbc_compiled,
+        PREPARE_VARIANTS[variant].optimize);
     if (!hbc_compiled.empty()) {
-      auto hbc_buffer = std::make_shared<StringBuffer>(hbc_compiled);
+      // Release the source copy before the VM gets going.
+      std::string().swap(source_str);
+      auto hbc_buffer =
+          StringBuffer::bufferFromString(std::move(hbc_compiled));
       prepared_script_store_->persistPreparedScript(
-          hbc_buffer, scriptSignature, runtimeSignature, "hermes");
+          hbc_buffer,
+          scriptSignature,
+          runtimeSignature,
+          PREPARE_VARIANTS[variant].tag);
+      claim.release();
 
-      return base_->evaluateJavaScript(hbc_buffer, sourceURL);
+      return runtime_.evaluateJavaScript(hbc_buffer, sourceURL);
     } else {
-      return base_->evaluateJavaScript(source, sourceURL);
+      claim.release();
+      return runtime_.evaluateJavaScript(source, sourceURL);
     }
   }
 
+  std::shared_ptr<const jsi::Buffer> waitForPreparedScript(
+      const jsi::ScriptSignature &scriptSignature,
+      const jsi::JSRuntimeSignature &runtimeSignature,
+      size_t variant) {
+    auto deadline = std::chrono::steady_clock::now() + PREPARE_CLAIM_WAIT;
+    do {
+      std::this_thread::sleep_for(PREPARE_CLAIM_POLL_INTERVAL);
+      std::shared_ptr<const jsi::Buffer> hbc_deser =
+          tryGetPreparedScript(scriptSignature, runtimeSignature, variant);
+      if (hbc_deser) {
+        return hbc_deser;
+      }
+    } while (std::chrono::steady_clock::now() < deadline);
+
+    return nullptr;
+  }
+
+  facebook::jsi::Runtime &runtime_;
+  std::unique_ptr<facebook::jsi::ScriptStore> script_store_;
+  // Shared with the background compilation jobs which may outlive us.
+  std::shared_ptr<facebook::jsi::PreparedScriptStore> prepared_script_store_;
+  std::shared_ptr<BackgroundScriptCompiler> background_compiler_;
+  PreparedScriptVariantPolicy variant_policy_;
+};
+
+// Note:: Unfortunately, we can't override from the concrete implementation
+// which is HermesRuntimeImpl, which has perf implications due to multiple
+// virtual pointer chases! makeDirectPreparedScriptHermesRuntime avoids them.
+class DynamicPreparedScriptHermesRuntime
+    : public facebook::jsi::RuntimeDecorator<
+          facebook::hermes::HermesRuntime,
+          facebook::jsi::Runtime> {
+ public:
+  DynamicPreparedScriptHermesRuntime(
+      std::unique_ptr<facebook::hermes::HermesRuntime> base,
+      std::unique_ptr<facebook::jsi::ScriptStore> script_store,
+      std::unique_ptr<facebook::jsi::PreparedScriptStore> prepared_script_store,
+      PreparedScriptCompileMode compile_mode,
+      PreparedScriptVariantPolicy variant_policy)
+      : facebook::jsi::RuntimeDecorator<
+            facebook::hermes::HermesRuntime,
+            facebook::jsi::Runtime>(*base),
+        base_(std::move(base)),
+        loader_(
+            *base_,
+            std::move(script_store),
+            std::move(prepared_script_store),
+            compile_mode,
+            variant_policy) {}
+
+  jsi::Value evaluateJavaScript(
+      const std::shared_ptr<const jsi::Buffer> &source,
+      const std::string &sourceURL) override {
+    return loader_.evaluateJavaScript(source, sourceURL);
+  }
+
+  jsi::Value evaluateJavaScriptFromScriptStore(const std::string &url) {
+    return loader_.evaluateJavaScriptFromScriptStore(url);
+  }
+
  private:
   std::unique_ptr<facebook::hermes::HermesRuntime> base_;
-  std::unique_ptr<facebook::jsi::PreparedScriptStore> prepared_script_store_;
+  PreparedScriptLoaderImpl loader_;
 };
 
-__declspec(dllexport) std::
+HERMESW_API std::
     unique_ptr<facebook::jsi::Runtime> makeDynamicPreparedScriptHermesRuntime(
         std::unique_ptr<facebook::jsi::PreparedScriptStore>
             prepared_script_store) {
+  return makeDynamicPreparedScriptHermesRuntime(
+      std::move(prepared_script_store), PreparedScriptCompileMode::Synchronous);
+}
+
+HERMESW_API std::
+    unique_ptr<facebook::jsi::Runtime> makeDynamicPreparedScriptHermesRuntime(
+        std::unique_ptr<facebook::jsi::PreparedScriptStore>
+            prepared_script_store,
+        PreparedScriptCompileMode compile_mode) {
+  return makeDynamicPreparedScriptHermesRuntime(
+      nullptr, std::move(prepared_script_store), compile_mode);
+}
+
+HERMESW_API std::
+    unique_ptr<facebook::jsi::Runtime> makeDynamicPreparedScriptHermesRuntime(
+        std::unique_ptr<facebook::jsi::ScriptStore> script_store,
+        std::unique_ptr<facebook::jsi::PreparedScriptStore>
+            prepared_script_store) {
+  return makeDynamicPreparedScriptHermesRuntime(
+      std::move(script_store),
+      std::move(prepared_script_store),
+      PreparedScriptCompileMode::Synchronous);
+}
+
+HERMESW_API std::
+    unique_ptr<facebook::jsi::Runtime> makeDynamicPreparedScriptHermesRuntime(
+        std::unique_ptr<facebook::jsi::ScriptStore> script_store,
+        std::unique_ptr<facebook::jsi::PreparedScriptStore>
+            prepared_script_store,
+        PreparedScriptCompileMode compile_mode) {
+  return makeDynamicPreparedScriptHermesRuntime(
+      std::move(script_store),
+      std::move(prepared_script_store),
+      compile_mode,
+      HermesRuntimeConfig{});
+}
+
+HERMESW_API std::
+    unique_ptr<facebook::jsi::Runtime> makeDynamicPreparedScriptHermesRuntime(
+        std::unique_ptr<facebook::jsi::ScriptStore> script_store,
+        std::unique_ptr<facebook::jsi::PreparedScriptStore>
+            prepared_script_store,
+        PreparedScriptCompileMode compile_mode,
+        const HermesRuntimeConfig &config) {
   return std::make_unique<DynamicPreparedScriptHermesRuntime>(
-      facebook::hermes::makeHermesRuntime(), std::move(prepared_script_store));
+      makeConfiguredHermesRuntime(config),
+      std::move(script_store),
+      std::move(prepared_script_store),
+      compile_mode,
+      config.preparedScriptVariantPolicy);
+}
+
+HERMESW_API facebook::jsi::Value evaluateJavaScriptFromScriptStore(
+    facebook::jsi::Runtime &runtime,
+    const std::string &url) {
+  auto *dynamic_runtime =
+      dynamic_cast<DynamicPreparedScriptHermesRuntime *>(&runtime);
+  if (!dynamic_runtime) {
+    throw jsi::JSINativeException(
+        "Runtime was not made by makeDynamicPreparedScriptHermesRuntime");
+  }
+
+  return dynamic_runtime->evaluateJavaScriptFromScriptStore(url);
+}
+
+HERMESW_API DirectHermesRuntime makeDirectPreparedScriptHermesRuntime(
+    std::unique_ptr<facebook::jsi::ScriptStore> script_store,
+    std::unique_ptr<facebook::jsi::PreparedScriptStore> prepared_script_store,
+    PreparedScriptCompileMode compile_mode) {
+  return makeDirectPreparedScriptHermesRuntime(
+      std::move(script_store),
+      std::move(prepared_script_store),
+      compile_mode,
+      HermesRuntimeConfig{});
+}
+
+HERMESW_API DirectHermesRuntime makeDirectPreparedScriptHermesRuntime(
+    std::unique_ptr<facebook::jsi::ScriptStore> script_store,
+    std::unique_ptr<facebook::jsi::PreparedScriptStore> prepared_script_store,
+    PreparedScriptCompileMode compile_mode,
+    const HermesRuntimeConfig &config) {
+  DirectHermesRuntime direct;
+  direct.runtime = makeConfiguredHermesRuntime(config);
+  direct.loader = std::make_unique<PreparedScriptLoaderImpl>(
+      *direct.runtime,
+      std::move(script_store),
+      std::move(prepared_script_store),
+      compile_mode,
+      config.preparedScriptVariantPolicy);
+  return direct;
+}
+
+class HermesRuntimePoolImpl : public HermesRuntimePool {
+ public:
+  HermesRuntimePoolImpl(
+      std::function<std::unique_ptr<facebook::jsi::Runtime>()> make_runtime,
+      HermesRuntimePoolConfig config)
+      : make_runtime_(std::move(make_runtime)),
+        config_(std::move(config)),
+        warmer_(&HermesRuntimePoolImpl::run, this) {}
+
+  ~HermesRuntimePoolImpl() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    warmer_.join();
+  }
+
+  std::unique_ptr<facebook::jsi::Runtime> acquire() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!ready_.empty()) {
+        std::unique_ptr<facebook::jsi::Runtime> runtime =
+            std::move(ready_.front());
+        ready_.pop_front();
+        cv_.notify_all();
+        return runtime;
+      }
+    }
+
+    // The warmer can't keep up (or gave up), don't make the caller wait on it.
+    return makeWarmRuntime();
+  }
+
+ private:
+  std::unique_ptr<facebook::jsi::Runtime> makeWarmRuntime() {
+    std::unique_ptr<facebook::jsi::Runtime> runtime = make_runtime_();
+    if (runtime && config_.prelude) {
+      runtime->evaluateJavaScript(config_.prelude, config_.preludeURL);
+    }
+    return runtime;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() {
+        return stopping_ || ready_.size() < config_.size;
+      });
+      if (stopping_)
+        return;
+
+      lock.unlock();
+      std::unique_ptr<facebook::jsi::Runtime> runtime;
+      try {
+        runtime = makeWarmRuntime();
+      } catch (const std::exception &) {
+      }
+      lock.lock();
+
+      if (!runtime) {
+        // It would fail the same way again, e.g. a prelude which throws. Let
+        // acquire make the runtimes, so that the caller gets the error.
+        return;
+      }
+      ready_.push_back(std::move(runtime));
+    }
+  }
+
+  std::function<std::unique_ptr<facebook::jsi::Runtime>()> make_runtime_;
+  HermesRuntimePoolConfig config_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::unique_ptr<facebook::jsi::Runtime>> ready_;
+  bool stopping_{false};
+
+  // Last, so that everything else is set up before the thread starts.
+  std::thread warmer_;
+};
+
+HERMESW_API std::unique_ptr<HermesRuntimePool> makeHermesRuntimePool(
+    std::function<std::unique_ptr<facebook::jsi::Runtime>()> makeRuntime,
+    HermesRuntimePoolConfig config) {
+  return std::make_unique<HermesRuntimePoolImpl>(
+      std::move(makeRuntime), std::move(config));
+}
+
+HERMESW_API PreparedScriptStats getPreparedScriptStats() {
+  return {g_prepared_script_counters.hits,
+          g_prepared_script_counters.misses,
+          g_prepared_script_counters.compiles_in_flight,
+          g_prepared_script_counters.compiles_completed,
+          g_prepared_script_counters.compiles_dropped,
+          g_prepared_script_counters.version_mismatches,
+          g_prepared_script_counters.compiles_deferred};
 }
 
-__declspec(dllexport)
+HERMESW_API
     std::unique_ptr<facebook::jsi::Runtime> makeDebugHermesRuntime() {
+  return makeDebugHermesRuntime(HermesRuntimeConfig{});
+}
+
+HERMESW_API std::unique_ptr<facebook::jsi::Runtime>
+makeDebugHermesRuntime(const HermesRuntimeConfig &config) {
+  return makeDebugHermesRuntime(nullptr, config);
+}
+
+HERMESW_API std::unique_ptr<facebook::jsi::Runtime>
+makeDebugHermesRuntime(
+    std::unique_ptr<facebook::jsi::PreparedScriptStore> prepared_script_store,
+    const HermesRuntimeConfig &config) {
   return std::make_unique<DebugHermesRuntime>(
-      facebook::hermes::makeHermesRuntime());
+      makeConfiguredHermesRuntime(config),
+      std::move(prepared_script_store),
+      config);
 }
\ No newline at end of file
@@ -1,13 +1,198 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <string>
 
 #include <jsi/ScriptStore.h>
 #include <jsi/jsi.h>
 
-__declspec(dllexport) std::
+#ifdef _WIN32
+#define HERMESW_API __declspec(dllexport)
+#else
+#define HERMESW_API __attribute__((visibility("default")))
+#endif
+
+// How makeDynamicPreparedScriptHermesRuntime deals with a script which has no
+// prepared script in the store yet.
+enum class PreparedScriptCompileMode {
+  // Compile to bytecode on the calling thread, persist it and run the bytecode.
+  Synchronous,
+  // Run the source right away, and compile and persist the bytecode on a
+  // background worker so that the next load of the script hits the store.
+  Background,
+};
+
+// Process wide prepared script counters, across all the runtimes.
+struct PreparedScriptStats {
+  uint64_t hits;
+  uint64_t misses;
+  // Background compilations queued or running.
+  uint64_t compilesInFlight;
+  uint64_t compilesCompleted;
+  // Background compilations skipped because the queue was full.
+  uint64_t compilesDropped;
+  // Prepared scripts found in the store but built for another bytecode
+  // version, and recompiled.
+  uint64_t versionMismatches;
+  // Compilations left to another runtime, possibly in another process, which
+  // was preparing the same script.
+  uint64_t compilesDeferred;
+};
+
+// Which of the ways of preparing a script the prepared script runtimes use.
+enum class PreparedScriptVariantPolicy {
+  // Always the optimized bytecode.
+  Optimized,
+  // Try each variant on a few loads of a script, then stick to the one which
+  // evaluated fastest. The timings are kept in the prepared script store.
+  Measured,
+};
+
+// Forwarded to the Hermes runtime configuration. Zero keeps the Hermes default.
+struct HermesRuntimeConfig {
+  // Initial and maximum size of the GC heap, in bytes.
+  uint32_t initHeapSize = 0;
+  uint32_t maxHeapSize = 0;
+  // Size of the register stack, which bounds the JS recursion depth.
+  uint32_t maxNumRegisters = 0;
+  // Compile functions from source on their first call rather than all up
+  // front. Only affects the debug runtime, which always runs from source;
+  // Hermes picks lazy compilation for large sources by itself otherwise.
+  bool lazyCompilation = false;
+
+  // Not forwarded, used by the prepared script runtimes themselves.
+  PreparedScriptVariantPolicy preparedScriptVariantPolicy =
+      PreparedScriptVariantPolicy::Optimized;
+
+  // Inspector server of the debug runtimes. It is shared by all of the debug
+  // runtimes of the process, each one a target listed at /json/list, and is
+  // started with the settings of the first one.
+  uint16_t inspectorPort = 8888;
+  uint32_t inspectorThreadCount = 1;
+};
+
+HERMESW_API std::
     unique_ptr<facebook::jsi::Runtime> makeDynamicPreparedScriptHermesRuntime(
         std::unique_ptr<facebook::jsi::PreparedScriptStore>);
 
-__declspec(dllexport)
-    std::unique_ptr<facebook::jsi::Runtime> makeDebugHermesRuntime();
\ No newline at end of file
+HERMESW_API std::
+    unique_ptr<facebook::jsi::Runtime> makeDynamicPreparedScriptHermesRuntime(
+        std::unique_ptr<facebook::jsi::PreparedScriptStore>,
+        PreparedScriptCompileMode compileMode);
+
+// Same as above, but scripts can also be loaded by url from the script store
+// through evaluateJavaScriptFromScriptStore. The script store is asked for the
+// version first, so scripts with a prepared script in the store are neither
+// read nor hashed, as long as the script store knows the version without
+// reading the script. BaseScriptStoreImpl does for scripts it hashed before.
+HERMESW_API std::
+    unique_ptr<facebook::jsi::Runtime> makeDynamicPreparedScriptHermesRuntime(
+        std::unique_ptr<facebook::jsi::ScriptStore>,
+        std::unique_ptr<facebook::jsi::PreparedScriptStore>);
+
+HERMESW_API std::
+    unique_ptr<facebook::jsi::Runtime> makeDynamicPreparedScriptHermesRuntime(
+        std::unique_ptr<facebook::jsi::ScriptStore>,
+        std::unique_ptr<facebook::jsi::PreparedScriptStore>,
+        PreparedScriptCompileMode compileMode);
+
+HERMESW_API std::
+    unique_ptr<facebook::jsi::Runtime> makeDynamicPreparedScriptHermesRuntime(
+        std::unique_ptr<facebook::jsi::ScriptStore>,
+        std::unique_ptr<facebook::jsi::PreparedScriptStore>,
+        PreparedScriptCompileMode compileMode,
+        const HermesRuntimeConfig &config);
+
+// Evaluates the script at url, as provided by the script store of a runtime
+// made by makeDynamicPreparedScriptHermesRuntime. Throws a
+// jsi::JSINativeException if the runtime has no script store or the script
+// can't be loaded.
+HERMESW_API facebook::jsi::Value evaluateJavaScriptFromScriptStore(
+    facebook::jsi::Runtime &runtime,
+    const std::string &url);
+
+// Evaluates scripts in a runtime through a prepared script store.
+class PreparedScriptLoader {
+ public:
+  virtual ~PreparedScriptLoader() = default;
+
+  virtual facebook::jsi::Value evaluateJavaScript(
+      const std::shared_ptr<const facebook::jsi::Buffer> &source,
+      const std::string &sourceURL) = 0;
+
+  // See evaluateJavaScriptFromScriptStore below.
+  virtual facebook::jsi::Value evaluateJavaScriptFromScriptStore(
+      const std::string &url) = 0;
+};
+
+struct DirectHermesRuntime {
+  std::unique_ptr<facebook::jsi::Runtime> runtime;
+  // Evaluates into runtime, which it must not outlive.
+  std::unique_ptr<PreparedScriptLoader> loader;
+};
+
+// Same behavior as makeDynamicPreparedScriptHermesRuntime, but the runtime is
+// the plain Hermes runtime rather than a decorator around it, so that JSI calls
+// (property accesses, function calls, host functions...) don't pay for a second
+// virtual dispatch. Scripts must be evaluated through the loader for the stores
+// to be used, runtime->evaluateJavaScript bypasses them.
+HERMESW_API DirectHermesRuntime makeDirectPreparedScriptHermesRuntime(
+    std::unique_ptr<facebook::jsi::ScriptStore>,
+    std::unique_ptr<facebook::jsi::PreparedScriptStore>,
+    PreparedScriptCompileMode compileMode);
+
+HERMESW_API DirectHermesRuntime makeDirectPreparedScriptHermesRuntime(
+    std::unique_ptr<facebook::jsi::ScriptStore>,
+    std::unique_ptr<facebook::jsi::PreparedScriptStore>,
+    PreparedScriptCompileMode compileMode,
+    const HermesRuntimeConfig &config);
+
+// Keeps runtimes made and warmed up ahead of time by a background thread, so
+// that getting one doesn't pay for the VM initialization and the prelude.
+class HermesRuntimePool {
+ public:
+  virtual ~HermesRuntimePool() = default;
+
+  // Hands out a warm runtime, and starts warming its replacement. Makes one on
+  // the calling thread if none is ready.
+  virtual std::unique_ptr<facebook::jsi::Runtime> acquire() = 0;
+};
+
+struct HermesRuntimePoolConfig {
+  // Number of runtimes kept ready.
+  size_t size;
+  // Evaluated into every runtime before it is handed out. Optional.
+  std::shared_ptr<const facebook::jsi::Buffer> prelude;
+  std::string preludeURL;
+};
+
+// makeRuntime is called on the pool's thread, e.g. a lambda around one of the
+// factories above, making a new prepared script store for every runtime.
+HERMESW_API std::unique_ptr<HermesRuntimePool> makeHermesRuntimePool(
+    std::function<std::unique_ptr<facebook::jsi::Runtime>()> makeRuntime,
+    HermesRuntimePoolConfig config);
+
+HERMESW_API PreparedScriptStats getPreparedScriptStats();
+
+HERMESW_API
+    std::unique_ptr<facebook::jsi::Runtime> makeDebugHermesRuntime();
+
+HERMESW_API std::unique_ptr<facebook::jsi::Runtime>
+makeDebugHermesRuntime(const HermesRuntimeConfig &config);
+
+// Keeps the sources the debugger may ask for in the prepared script store
+// rather than in memory, and reads them back when it does. The store can be
+// the one the production runtimes use, handed over through a forwarding store
+// since this takes ownership; the sources go under a tag of their own. They are
+// written in the background, unless the store has them already, and kept in
+// memory until the store hands them back. Pin "_debug-source.cache" in a
+// QuotaBufferStore, so that the debugger still finds them after an eviction.
+// Only the sources are moved out; the prepared bytecode keeps the throw site
+// locations compileJS emits, as the production runtimes need them for stack
+// traces.
+HERMESW_API std::unique_ptr<facebook::jsi::Runtime>
+makeDebugHermesRuntime(
+    std::unique_ptr<facebook::jsi::PreparedScriptStore> prepared_script_store,
+    const HermesRuntimeConfig &config);
\ No newline at end of file
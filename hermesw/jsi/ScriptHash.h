@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <jsi/ScriptStore.h>
+#include <jsi/jsi.h>
+
+namespace facebook {
+namespace jsi {
+
+namespace detail {
+
+constexpr uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t xxhRotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Unaligned little endian loads. All our targets are little endian.
+inline uint64_t xxhRead64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t xxhRead32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME64_2;
+  acc = xxhRotl64(acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+inline uint64_t xxhMergeRound(uint64_t acc, uint64_t val) {
+  acc ^= xxhRound(0, val);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+} // namespace detail
+
+// XXH64 (https://github.com/Cyan4973/xxHash). The main loop runs four
+// independent accumulators over 32 byte stripes which keeps the multipliers
+// busy and is auto-vectorizable, hashing at memory bandwidth speeds. It is
+// not cryptographic; it only needs to tell script contents apart.
+inline uint64_t xxhash64(const uint8_t *data, size_t len, uint64_t seed = 0) {
+  using namespace detail;
+
+  const uint8_t *p = data;
+  const uint8_t *const end = data + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    const uint8_t *const limit = end - 32;
+    uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = seed + XXH_PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_PRIME64_1;
+
+    do {
+      v1 = xxhRound(v1, xxhRead64(p));
+      v2 = xxhRound(v2, xxhRead64(p + 8));
+      v3 = xxhRound(v3, xxhRead64(p + 16));
+      v4 = xxhRound(v4, xxhRead64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = xxhRotl64(v1, 1) + xxhRotl64(v2, 7) + xxhRotl64(v3, 12) +
+        xxhRotl64(v4, 18);
+    h = xxhMergeRound(h, v1);
+    h = xxhMergeRound(h, v2);
+    h = xxhMergeRound(h, v3);
+    h = xxhMergeRound(h, v4);
+  } else {
+    h = seed + XXH_PRIME64_5;
+  }
+
+  h += static_cast<uint64_t>(len);
+
+  while (p + 8 <= end) {
+    h ^= xxhRound(0, xxhRead64(p));
+    h = xxhRotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    p += 8;
+  }
+
+  if (p + 4 <= end) {
+    h ^= static_cast<uint64_t>(xxhRead32(p)) * XXH_PRIME64_1;
+    h = xxhRotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+
+  while (p < end) {
+    h ^= (*p) * XXH_PRIME64_5;
+    h = xxhRotl64(h, 11) * XXH_PRIME64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+// Content derived script version. Two buffers get the same version if and only if (modulo hash collisions) they have the same bytes,
+// which makes the version safe to use both for invalidation and as a store key shared by all urls serving the same bundle.
+inline ScriptVersion_t computeScriptVersion(const uint8_t *data, size_t len) {
+  ScriptVersion_t version = xxhash64(data, len);
+  // 0 is reserved for "versioning not available".
+  return version ? version : 1;
+}
+
+inline ScriptVersion_t computeScriptVersion(const Buffer &buffer) {
+  return computeScriptVersion(buffer.data(), buffer.size());
+}
+
+} // namespace jsi
+} // namespace facebook
@@ -7,6 +7,8 @@ namespace facebook {
 namespace jsi {
 
 // Integer type as it's persist friently.
+// The version must change whenever the content of the script at a given url changes. Versions computed with computeScriptVersion
+// (see ScriptHash.h) go further and identify the content itself, see ScriptSignature::contentVersion.
 using ScriptVersion_t = uint64_t;  // It shouldbe std::optional<uint64_t> once we have c++17 available everywhere. Until then, 0 implies versioning not available.
 using JSRuntimeVersion_t = uint64_t; // 0 implies version can't be computed. We assert whenever that happens.
 
@@ -18,6 +20,9 @@ struct VersionedBuffer {
 struct ScriptSignature {
   std::string url;
   ScriptVersion_t version;
+  // Whether the version is a content hash computed with computeScriptVersion, rather than e.g. a build number. Only then are two scripts
+  // with the same version assumed to be byte identical, and prepared script stores free to share a prepared script between their urls.
+  bool contentVersion = false;
 };
 
 struct JSRuntimeSignature {
@@ -52,6 +57,27 @@ struct PreparedScriptStore {
     const JSRuntimeSignature& runtimeMetadata,
     const char* prepareTag  // Optional tag. For e.g. eagerly evaluated vs lazy cache.
   ) noexcept = 0;
+
+  // Hint that the runtime is starting up. Stores which know which prepared scripts will be asked for (e.g. because they recorded the lookups of
+  // the previous run) can start loading them in the background, so that the lookups which follow don't wait on the disk one after another.
+  // Must not block on the loads. Stores are free to ignore all but the first call.
+  virtual void prefetchPreparedScripts() noexcept {}
+
+  // Claim the preparation of a script, so that runtimes sharing the store, possibly in different processes, don't all prepare the same one.
+  // Returns false while the claim is held elsewhere, in which case the caller should wait for the prepared script to show up or use the source.
+  // A granted claim must be released with endPreparingScript once the prepared script is persisted, or preparing it failed.
+  // Stores which can't coordinate preparations always grant the claim. Must not block.
+  virtual bool tryBeginPreparingScript(
+    const ScriptSignature& /*scriptSignature*/,
+    const JSRuntimeSignature& /*runtimeSignature*/,
+    const char* /*prepareTag*/) noexcept {
+    return true;
+  }
+
+  virtual void endPreparingScript(
+    const ScriptSignature& /*scriptSignature*/,
+    const JSRuntimeSignature& /*runtimeSignature*/,
+    const char* /*prepareTag*/) noexcept {}
 };
 
 // JSI::Runtime implementation must be provided an instance on this interface to enable version sensitive capabilities such as usage of pre-prepared javascript script.
@@ -62,6 +88,11 @@ struct ScriptStore {
 
   // Return the version of the Javascript buffer corresponding to a given url.
   virtual ScriptVersion_t getScriptVersion(const std::string& url) noexcept = 0;
+
+  // Whether the versions returned are content hashes computed with computeScriptVersion.
+  virtual bool hasContentVersions() noexcept {
+    return false;
+  }
 };
 
 } // namespace jsi
@@ -1,18 +1,27 @@
 #include <boost/asio/bind_executor.hpp>
 #include <boost/asio/connect.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
+#include <boost/asio/write.hpp>
 #include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
+#include <boost/version.hpp>
 #include <algorithm>
+#include <cctype>
 #include <condition_variable>
+#include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "ws_session.h"
@@ -20,76 +29,490 @@
 using tcp = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
 namespace websocket =
     boost::beast::websocket; // from <boost/beast/websocket.hpp>
+namespace http = boost::beast::http; // from <boost/beast/http.hpp>
 
 // Report a failure
 void fail(boost::system::error_code ec, char const *what) {
   std::cerr << what << ": " << ec.message() << "\n";
 }
 
+// Socket which can hold writes back and send them later in one go. It sits
+// below the websocket stream, so that a batch of messages, each one still a
+// frame of its own, leaves in a single write rather than one write per message.
+//
+// The stream only knows about its own writes, not about the flushes. So the
+// socket keeps a single write in flight itself: a frame written meanwhile, e.g.
+// a pong or a close from the read side, waits for the flush to complete rather
+// than interleaving with it on the wire. All of it runs on the strand of the
+// session owning the stream, which the handlers are bound to.
+class batching_socket {
+  tcp::socket socket_;
+  bool holding_{false};
+  std::string held_;
+  // What async_flush is writing, it must stay put until the write completes.
+  std::string flushing_;
+  // Whether a write, or the teardown, is in flight on socket_, and what waits
+  // for it to complete.
+  bool writing_{false};
+  std::deque<std::function<void()>> waiting_;
+
+  // Completes a write started by start_write on the executor of the handler
+  // it wraps, after starting the next one.
+  template <class Handler>
+  struct write_op {
+    batching_socket &socket;
+    Handler handler;
+
+    template <class... Args>
+    void operator()(Args &&... args) {
+      socket.write_done();
+      handler(std::forward<Args>(args)...);
+    }
+  };
+
+  template <class Executor, class Handler>
+  boost::asio::executor_binder<write_op<Handler>, Executor> wrap(
+      const Executor &executor,
+      Handler &&handler) {
+    return boost::asio::bind_executor(
+        executor, write_op<Handler>{*this, std::move(handler)});
+  }
+
+  template <class Handler>
+  auto wrap(Handler &&handler) {
+    auto executor =
+        boost::asio::get_associated_executor(handler, socket_.get_executor());
+    return wrap(executor, std::move(handler));
+  }
+
+  // start runs now, or once the write in flight completes. It must start a
+  // write whose handler is wrapped.
+  void start_write(std::function<void()> start) {
+    if (writing_) {
+      waiting_.push_back(std::move(start));
+      return;
+    }
+
+    writing_ = true;
+    start();
+  }
+
+  void write_done() {
+    writing_ = false;
+    if (waiting_.empty())
+      return;
+
+    std::function<void()> start = std::move(waiting_.front());
+    waiting_.pop_front();
+    writing_ = true;
+    start();
+  }
+
+ public:
+  using executor_type = tcp::socket::executor_type;
+
+  explicit batching_socket(boost::asio::io_context &ioc) : socket_(ioc) {}
+  explicit batching_socket(tcp::socket socket) : socket_(std::move(socket)) {}
+
+  executor_type get_executor() noexcept {
+    return socket_.get_executor();
+  }
+
+  tcp::socket &socket() {
+    return socket_;
+  }
+
+  // Until async_flush, writes are copied aside and complete right away.
+  void hold() {
+    holding_ = true;
+  }
+
+  bool holding() const {
+    return holding_;
+  }
+
+  template <class WriteHandler>
+  void async_flush(WriteHandler &&handler) {
+    holding_ = false;
+    // std::function wants a copyable target, the handler may not be.
+    auto op = std::make_shared<typename std::decay<WriteHandler>::type>(
+        std::forward<WriteHandler>(handler));
+    start_write([this, op]() {
+      flushing_.swap(held_);
+      held_.clear();
+      boost::asio::async_write(
+          socket_, boost::asio::buffer(flushing_), wrap(std::move(*op)));
+    });
+  }
+
+  // The stream tears the connection down as soon as it has written a close
+  // frame, which may still be held or waiting for a flush. The teardown waits
+  // for them to go out.
+  template <class TeardownHandler>
+  void async_teardown(boost::beast::role_type role, TeardownHandler &&handler) {
+    auto op = std::make_shared<typename std::decay<TeardownHandler>::type>(
+        std::forward<TeardownHandler>(handler));
+    auto executor =
+        boost::asio::get_associated_executor(*op, socket_.get_executor());
+
+    if (!held_.empty()) {
+      holding_ = false;
+      start_write([this, executor]() {
+        flushing_.swap(held_);
+        held_.clear();
+        boost::asio::async_write(
+            socket_,
+            boost::asio::buffer(flushing_),
+            wrap(executor, [](boost::system::error_code, std::size_t) {}));
+      });
+    }
+
+    start_write([this, role, op]() {
+      websocket::async_teardown(role, socket_, wrap(std::move(*op)));
+    });
+  }
+
+  template <class MutableBufferSequence, class ReadHandler>
+  void async_read_some(
+      const MutableBufferSequence &buffers,
+      ReadHandler &&handler) {
+    socket_.async_read_some(buffers, std::forward<ReadHandler>(handler));
+  }
+
+  template <class ConstBufferSequence, class WriteHandler>
+  void async_write_some(
+      const ConstBufferSequence &buffers,
+      WriteHandler &&handler) {
+    if (!holding_) {
+      auto op = std::make_shared<typename std::decay<WriteHandler>::type>(
+          std::forward<WriteHandler>(handler));
+      start_write([this, buffers, op]() {
+        socket_.async_write_some(buffers, wrap(std::move(*op)));
+      });
+      return;
+    }
+
+    size_t size = boost::asio::buffer_size(buffers);
+    size_t offset = held_.size();
+    held_.resize(offset + size);
+    boost::asio::buffer_copy(
+        boost::asio::buffer(&held_[offset], size), buffers);
+
+    // bind_handler keeps the handler's executor, i.e. the session's strand.
+    boost::asio::post(
+        socket_.get_executor(),
+        boost::beast::bind_handler(
+            std::forward<WriteHandler>(handler),
+            boost::system::error_code(),
+            size));
+  }
+};
+
+// Closing the websocket, or timing out, tears down the socket underneath.
+void beast_close_socket(batching_socket &socket) {
+  boost::beast::close_socket(socket.socket());
+}
+
+void teardown(
+    boost::beast::role_type role,
+    batching_socket &socket,
+    boost::system::error_code &ec) {
+  websocket::teardown(role, socket.socket(), ec);
+}
+
+template <class TeardownHandler>
+void async_teardown(
+    boost::beast::role_type role,
+    batching_socket &socket,
+    TeardownHandler &&handler) {
+  socket.async_teardown(role, std::forward<TeardownHandler>(handler));
+}
+
+class ws_session;
+
+// Hands the sessions accepted by a shared server over to their targets, going
+// by the path of the upgrade request.
+struct web_socket_router {
+  virtual ~web_socket_router() = default;
+  // Returns false if there is no target at the path.
+  virtual bool route(
+      const std::string &path,
+      const std::shared_ptr<ws_session> &session) = 0;
+  // Answers plain HTTP GETs, i.e. target discovery. Returns false for a 404.
+  virtual bool describe(
+      const std::string &path,
+      const std::string &host,
+      std::string &body) = 0;
+};
+
+// All the operations on the stream and all the session state below, bar
+// read_func_ and close_func_, are confined to strand_. write and close may be
+// called from any thread, they post to the strand.
 class ws_session : public std::enable_shared_from_this<ws_session>,
                    public web_socket_session_interface {
+  boost::asio::strand<boost::asio::io_context::executor_type> strand_;
   tcp::resolver resolver_;
-  websocket::stream<tcp::socket> ws_;
+  websocket::stream<batching_socket> ws_;
   boost::beast::flat_buffer buffer_;
   std::string host_;
+  web_socket_options options_;
 
   std::function<void(std::string)> read_func_;
+  std::function<void()> close_func_;
   std::function<void(std::shared_ptr<web_socket_session_interface>)>
       on_connected_func_;
 
-  std::mutex write_queue_mutex_;
-  std::vector<std::string> write_queue_;
-  std::condition_variable write_queue_cv;
+  // Routed servers read the upgrade request themselves, to pick the target.
+  std::shared_ptr<web_socket_router> router_;
+  http::request<http::string_body> request_;
+  http::response<http::string_body> response_;
 
-  std::thread write_thread;
+  // Messages waiting to be written. While writing_ is set, the first
+  // batch_count_ of them are the batch being written. Writes only start once
+  // the handshake is done.
+  std::deque<std::string> write_queue_;
+  size_t queued_bytes_{0};
+  size_t batch_count_{0};
+  bool connected_{false};
+  bool writing_{false};
+  bool batch_scheduled_{false};
+  // A close waits for the messages written before it, which keeps its frame
+  // out of the middle of a batch too.
+  bool close_pending_{false};
+  // Bounds how long a message waits for others to batch with.
+  boost::asio::steady_timer batch_timer_;
 
  public:
   // client
   explicit ws_session(
       boost::asio::io_context &ioc,
+      const web_socket_options &options,
       std::function<void(std::shared_ptr<web_socket_session_interface>)>
           on_connected_func)
-      : resolver_(ioc), ws_(ioc), on_connected_func_(on_connected_func) {}
+      : strand_(ioc.get_executor()),
+        resolver_(ioc),
+        ws_(ioc),
+        options_(options),
+        on_connected_func_(on_connected_func),
+        batch_timer_(ioc) {}
 
   // server
   // Take ownership of the socket
   explicit ws_session(
       boost::asio::io_context &ioc,
       tcp::socket socket,
+      const web_socket_options &options,
       std::function<void(std::shared_ptr<web_socket_session_interface>)>
           on_connected_func)
-      : resolver_(ioc), ws_(std::move(socket)) {}
+      : strand_(ioc.get_executor()),
+        resolver_(ioc),
+        ws_(std::move(socket)),
+        options_(options),
+        batch_timer_(ioc) {}
+
+  // server, handing the session to the target at the request path
+  explicit ws_session(
+      boost::asio::io_context &ioc,
+      tcp::socket socket,
+      const web_socket_options &options,
+      std::shared_ptr<web_socket_router> router)
+      : strand_(ioc.get_executor()),
+        resolver_(ioc),
+        ws_(std::move(socket)),
+        options_(options),
+        router_(std::move(router)),
+        batch_timer_(ioc) {}
 
   void write(std::string text) override {
-    std::lock_guard<std::mutex> lk(write_queue_mutex_);
-    write_queue_.emplace_back(text);
-    write_queue_cv.notify_all();
+    boost::asio::post(
+        strand_,
+        [self = shared_from_this(), text = std::move(text)]() mutable {
+          self->queued_bytes_ += text.size();
+          self->write_queue_.push_back(std::move(text));
+          self->schedule_batch();
+        });
   }
 
-  void writer_thread_func() {
-    while (true) {
-      std::unique_lock<std::mutex> lk(write_queue_mutex_);
-      write_queue_cv.wait(lk, [this] { return !write_queue_.empty(); });
+  // Messages queued in the same io_context turn, or within the configured
+  // latency, go out as one batch. A full batch goes out right away.
+  void schedule_batch() {
+    if (!connected_ || writing_ || write_queue_.empty())
+      return;
 
-      std::vector<std::string> write_queue_copy = std::move(write_queue_);
-      lk.unlock();
+    if (batch_scheduled_) {
+      // Cut the wait short, the timer handler starts the batch.
+      if (queued_bytes_ >= options_.max_batch_bytes)
+        batch_timer_.cancel();
+      return;
+    }
+
+    batch_scheduled_ = true;
+    if (options_.max_batch_latency.count() == 0 ||
+        queued_bytes_ >= options_.max_batch_bytes) {
+      // Runs after the handlers already queued, which may add to the batch.
+      boost::asio::post(
+          strand_, [self = shared_from_this()]() { self->start_batch(); });
+    } else {
+      batch_timer_.expires_after(options_.max_batch_latency);
+      batch_timer_.async_wait(boost::asio::bind_executor(
+          strand_, [self = shared_from_this()](boost::system::error_code) {
+            self->start_batch();
+          }));
+    }
+  }
+
+  void start_batch() {
+    batch_scheduled_ = false;
+    if (writing_ || write_queue_.empty())
+      return;
+
+    // At least one message, however large.
+    size_t batch_bytes = write_queue_.front().size();
+    batch_count_ = 1;
+    while (batch_count_ < write_queue_.size() &&
+           batch_bytes + write_queue_[batch_count_].size() <=
+               options_.max_batch_bytes) {
+      batch_bytes += write_queue_[batch_count_].size();
+      batch_count_++;
+    }
+
+    // A lone message goes straight to the socket, without the copy.
+    if (batch_count_ > 1)
+      ws_.next_layer().hold();
+
+    writing_ = true;
+    do_write();
+  }
+
+  // websocket::stream allows only one write in flight, the messages of the
+  // batch are written one after the other.
+  void do_write() {
+    ws_.async_write(
+        boost::asio::buffer(write_queue_.front()),
+        boost::asio::bind_executor(
+            strand_,
+            boost::beast::bind_front_handler(
+                &ws_session::on_write, shared_from_this())));
+  }
+
+  void on_write(boost::system::error_code ec, std::size_t bytes_transferred) {
+    boost::ignore_unused(bytes_transferred);
 
-      for (std::string text : write_queue_copy) {
-        std::cout << "writer_thread_func" << text << std::endl;
-        ws_.write(boost::asio::buffer(text));
-      }
+    if (ec)
+      return on_write_failed(ec);
+
+    queued_bytes_ -= write_queue_.front().size();
+    write_queue_.pop_front();
+    if (--batch_count_ > 0)
+      return do_write();
+
+    if (ws_.next_layer().holding()) {
+      return ws_.next_layer().async_flush(boost::asio::bind_executor(
+          strand_,
+          boost::beast::bind_front_handler(
+              &ws_session::on_flush, shared_from_this())));
+    }
+
+    end_batch();
+  }
+
+  void on_flush(boost::system::error_code ec, std::size_t bytes_transferred) {
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec)
+      return on_write_failed(ec);
+
+    end_batch();
+  }
+
+  void on_write_failed(boost::system::error_code ec) {
+    // The stream is unusable from here on, and so are the queued messages.
+    write_queue_.clear();
+    queued_bytes_ = 0;
+    batch_count_ = 0;
+    fail(ec, "write");
+
+    // What was held may end with a frame the stream considers sent, e.g. the
+    // reply to a close.
+    if (ws_.next_layer().holding()) {
+      ws_.next_layer().async_flush(boost::asio::bind_executor(
+          strand_,
+          [self = shared_from_this()](
+              boost::system::error_code, std::size_t) {}));
     }
+
+    end_batch();
+  }
+
+  void end_batch() {
+    writing_ = false;
+    if (close_pending_ && write_queue_.empty()) {
+      close_pending_ = false;
+      return do_close();
+    }
+
+    schedule_batch();
   }
 
   void setOnRead(std::function<void(std::string)> func) override {
     read_func_ = func;
   }
 
+  void setOnClose(std::function<void()> func) override {
+    close_func_ = func;
+  }
+
+  // Drops the callbacks, which may well hold on to the session itself, and
+  // tells the owner the session is over.
+  void end_session() {
+    read_func_ = nullptr;
+    std::function<void()> close_func = std::move(close_func_);
+    close_func_ = nullptr;
+    if (close_func)
+      close_func();
+  }
+
   void close() {
+    boost::asio::post(strand_, [self = shared_from_this()]() {
+      self->do_close();
+    });
+  }
+
+  // Stops handing messages to read_func_ and closes the session. done is
+  // called on the strand, after close_func_, and neither callback is called
+  // again.
+  void detach(std::function<void()> done) {
+    boost::asio::post(strand_, [self = shared_from_this(), done]() {
+      self->end_session();
+      self->do_close();
+      done();
+    });
+  }
+
+  void do_close() {
+    if (!connected_) {
+      // No handshake to close yet, fail whatever is pending on the socket.
+      boost::system::error_code ec;
+      ws_.next_layer().socket().close(ec);
+      return;
+    }
+
+    if (!ws_.is_open())
+      return;
+
+    if (writing_ || !write_queue_.empty()) {
+      close_pending_ = true;
+      return;
+    }
+
     ws_.async_close(
         websocket::close_code::normal,
-        std::bind(
-            &ws_session::on_close, shared_from_this(), std::placeholders::_1));
+        boost::asio::bind_executor(
+            strand_,
+            std::bind(
+                &ws_session::on_close,
+                shared_from_this(),
+                std::placeholders::_1)));
   }
 
   void on_close(boost::system::error_code ec) {
@@ -97,16 +520,123 @@ class ws_session : public std::enable_shared_from_this<ws_session>,
       return fail(ec, "close");
   }
 
+  void set_deflate_option() {
+    if (!options_.deflate)
+      return;
+
+    // Beast throws for windows it doesn't support, which would take the whole
+    // process down from the handler this runs in.
+    int window_bits = std::min(std::max(options_.deflate_window_bits, 9), 15);
+
+    websocket::permessage_deflate deflate;
+    deflate.client_enable = true;
+    deflate.server_enable = true;
+    deflate.client_max_window_bits = window_bits;
+    deflate.server_max_window_bits = window_bits;
+#if BOOST_VERSION >= 107600
+    deflate.msg_size_threshold = options_.deflate_min_size;
+#endif
+    ws_.set_option(deflate);
+  }
+
   void run_server() {
-    ws_.async_accept(boost::beast::bind_front_handler(
-        &ws_session::on_accept, shared_from_this()));
+    boost::asio::post(strand_, [self = shared_from_this()]() {
+      self->set_deflate_option();
+      self->ws_.async_accept(boost::asio::bind_executor(
+          self->strand_,
+          boost::beast::bind_front_handler(&ws_session::on_accept, self)));
+    });
   }
 
-  void on_accept(boost::system::error_code ec) {
+  void run_routed_server() {
+    boost::asio::post(strand_, [self = shared_from_this()]() {
+      http::async_read(
+          self->ws_.next_layer(),
+          self->buffer_,
+          self->request_,
+          boost::asio::bind_executor(
+              self->strand_,
+              boost::beast::bind_front_handler(
+                  &ws_session::on_request, self)));
+    });
+  }
+
+  void on_request(
+      boost::system::error_code ec,
+      std::size_t bytes_transferred) {
+    boost::ignore_unused(bytes_transferred);
+
     if (ec)
+      return fail(ec, "read request");
+
+    auto target = request_.target();
+    std::string path(target.data(), target.size());
+
+    if (websocket::is_upgrade(request_)) {
+      // The target's on_connected_func runs here, before the handshake, like
+      // it does for the other servers.
+      if (!router_->route(path, shared_from_this()))
+        return respond(http::status::not_found, std::string());
+
+      set_deflate_option();
+      ws_.async_accept(
+          request_,
+          boost::asio::bind_executor(
+              strand_,
+              boost::beast::bind_front_handler(
+                  &ws_session::on_accept, shared_from_this())));
+      return;
+    }
+
+    auto host = request_[http::field::host];
+    std::string body;
+    if (request_.method() == http::verb::get &&
+        router_->describe(path, std::string(host.data(), host.size()), body))
+      return respond(http::status::ok, std::move(body));
+
+    respond(http::status::not_found, std::string());
+  }
+
+  // Answers a plain HTTP request, then closes the connection.
+  void respond(http::status status, std::string body) {
+    response_.result(status);
+    response_.version(request_.version());
+    response_.keep_alive(false);
+    response_.set(
+        http::field::content_type, "application/json; charset=UTF-8");
+    response_.body() = std::move(body);
+    response_.prepare_payload();
+
+    http::async_write(
+        ws_.next_layer(),
+        response_,
+        boost::asio::bind_executor(
+            strand_,
+            boost::beast::bind_front_handler(
+                &ws_session::on_respond, shared_from_this())));
+  }
+
+  void on_respond(
+      boost::system::error_code ec,
+      std::size_t bytes_transferred) {
+    boost::ignore_unused(bytes_transferred);
+
+    if (ec)
+      return fail(ec, "respond");
+
+    ws_.next_layer().socket().shutdown(tcp::socket::shutdown_send, ec);
+  }
+
+  void on_accept(boost::system::error_code ec) {
+    if (ec) {
+      // Routed targets already got the session.
+      end_session();
       return fail(ec, "accept");
+    }
 
-    write_thread = std::thread(&ws_session::writer_thread_func, this);
+    // Flush what was written before the handshake.
+    connected_ = true;
+    schedule_batch();
 
     // Read a message
     do_read();
@@ -117,15 +647,19 @@ class ws_session : public std::enable_shared_from_this<ws_session>,
     // Save these for later
     host_ = host;
 
+    set_deflate_option();
+
     // Look up the domain name
     resolver_.async_resolve(
         host,
         port,
-        std::bind(
-            &ws_session::on_resolve,
-            shared_from_this(),
-            std::placeholders::_1,
-            std::placeholders::_2));
+        boost::asio::bind_executor(
+            strand_,
+            std::bind(
+                &ws_session::on_resolve,
+                shared_from_this(),
+                std::placeholders::_1,
+                std::placeholders::_2)));
   }
 
   void on_resolve(
@@ -136,13 +670,15 @@ class ws_session : public std::enable_shared_from_this<ws_session>,
 
     // Make the connection on the IP address we get from a lookup
     boost::asio::async_connect(
-        ws_.next_layer(),
+        ws_.next_layer().socket(),
         results.begin(),
         results.end(),
-        std::bind(
-            &ws_session::on_connect,
-            shared_from_this(),
-            std::placeholders::_1));
+        boost::asio::bind_executor(
+            strand_,
+            std::bind(
+                &ws_session::on_connect,
+                shared_from_this(),
+                std::placeholders::_1)));
   }
 
   void on_connect(boost::system::error_code ec) {
@@ -153,10 +689,12 @@ class ws_session : public std::enable_shared_from_this<ws_session>,
     ws_.async_handshake(
         host_,
         "/",
-        std::bind(
-            &ws_session::on_handshake,
-            shared_from_this(),
-            std::placeholders::_1));
+        boost::asio::bind_executor(
+            strand_,
+            std::bind(
+                &ws_session::on_handshake,
+                shared_from_this(),
+                std::placeholders::_1)));
   }
 
   void on_handshake(boost::system::error_code ec) {
@@ -165,7 +703,8 @@ class ws_session : public std::enable_shared_from_this<ws_session>,
 
     on_connected_func_(shared_from_this());
 
-    write_thread = std::thread(&ws_session::writer_thread_func, this);
+    connected_ = true;
+    schedule_batch();
 
     // Read a message
     do_read();
@@ -175,30 +714,37 @@ class ws_session : public std::enable_shared_from_this<ws_session>,
     // Read a message into our buffer
     ws_.async_read(
         buffer_,
-        boost::beast::bind_front_handler(
-            &ws_session::on_read, shared_from_this()));
+        boost::asio::bind_executor(
+            strand_,
+            boost::beast::bind_front_handler(
+                &ws_session::on_read, shared_from_this())));
   }
 
   void on_read(boost::system::error_code ec, std::size_t bytes_transferred) {
     boost::ignore_unused(bytes_transferred);
 
-    // This indicates that the session was closed
-    if (ec == websocket::error::closed)
-      return;
+    if (ec) {
+      end_session();
 
-    if (ec)
-      fail(ec, "read");
+      // This indicates that the session was closed, by either side
+      if (ec == websocket::error::closed ||
+          ec == boost::asio::error::operation_aborted)
+        return;
+
+      return fail(ec, "read");
+    }
 
     ws_.text(ws_.got_text());
 
+    // The one copy of the message, which is then moved along. The buffer keeps
+    // its storage for the next read.
     std::string text = boost::beast::buffers_to_string(buffer_.data());
+    buffer_.consume(buffer_.size());
+
     if (read_func_ && !text.empty()) {
-      read_func_(text);
+      read_func_(std::move(text));
     }
 
-    // Clear the buffer
-    buffer_.consume(buffer_.size());
-
     // Read a message
     do_read();
   }
@@ -206,22 +752,48 @@ class ws_session : public std::enable_shared_from_this<ws_session>,
 
 // Accepts incoming connections and launches the sessions
 class listener : public std::enable_shared_from_this<listener> {
+  boost::asio::io_context &ioc_;
   tcp::acceptor acceptor_;
   tcp::socket socket_;
+  web_socket_options options_;
   std::function<void(std::shared_ptr<web_socket_session_interface>)>
       on_connected_func_;
-  boost::asio::io_context &ioc_;
+  std::shared_ptr<web_socket_router> router_;
 
  public:
   listener(
       boost::asio::io_context &ioc,
       tcp::endpoint endpoint,
+      const web_socket_options &options,
       std::function<void(std::shared_ptr<web_socket_session_interface>)>
           on_connected_func)
       : ioc_(ioc),
         acceptor_(ioc),
         socket_(ioc),
+        options_(options),
         on_connected_func_(on_connected_func) {
+    listen(endpoint);
+  }
+
+  listener(
+      boost::asio::io_context &ioc,
+      tcp::endpoint endpoint,
+      const web_socket_options &options,
+      std::shared_ptr<web_socket_router> router)
+      : ioc_(ioc),
+        acceptor_(ioc),
+        socket_(ioc),
+        options_(options),
+        router_(std::move(router)) {
+    listen(endpoint);
+  }
+
+  // Whether the listener could bind to its endpoint.
+  bool listening() const {
+    return acceptor_.is_open();
+  }
+
+  void listen(tcp::endpoint endpoint) {
     boost::system::error_code ec;
 
     // Open the acceptor
@@ -235,6 +807,7 @@ class listener : public std::enable_shared_from_this<listener> {
     acceptor_.bind(endpoint, ec);
     if (ec) {
       fail(ec, "bind");
+      acceptor_.close(ec);
       return;
     }
 
@@ -242,6 +815,7 @@ class listener : public std::enable_shared_from_this<listener> {
     acceptor_.listen(boost::asio::socket_base::max_listen_connections, ec);
     if (ec) {
       fail(ec, "listen");
+      acceptor_.close(ec);
       return;
     }
   }
@@ -264,10 +838,13 @@ class listener : public std::enable_shared_from_this<listener> {
   void on_accept(boost::system::error_code ec) {
     if (ec) {
       fail(ec, "accept");
+    } else if (router_) {
+      std::make_shared<ws_session>(ioc_, std::move(socket_), options_, router_)
+          ->run_routed_server();
     } else {
       // Create the session and run it
       auto session = std::make_shared<ws_session>(
-          ioc_, std::move(socket_), on_connected_func_);
+          ioc_, std::move(socket_), options_, on_connected_func_);
       on_connected_func_(session);
       session->run_server();
     }
@@ -277,14 +854,251 @@ class listener : public std::enable_shared_from_this<listener> {
   }
 };
 
+// Path prefix of the targets, the one Chrome DevTools uses.
+const std::string DEVTOOLS_PAGE_PATH = "/devtools/page/";
+
+std::string json_escape(const std::string &text) {
+  std::string escaped;
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", c);
+      escaped += code;
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+// Whether a Host header is a host name or address, with an optional port, and
+// can go into the URLs handed out as it is.
+bool is_host(const std::string &host) {
+  if (host.empty())
+    return false;
+
+  for (char c : host) {
+    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '.' && c != ':' &&
+        c != '[' && c != ']' && c != '-')
+      return false;
+  }
+  return true;
+}
+
+// The targets of a shared server, by id.
+class target_registry : public web_socket_router {
+  struct target {
+    std::string title;
+    std::function<void(std::shared_ptr<web_socket_session_interface>)>
+        on_connected_func;
+    std::vector<std::weak_ptr<ws_session>> sessions;
+  };
+
+  unsigned short port_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, target> targets_;
+
+ public:
+  explicit target_registry(unsigned short port) : port_(port) {}
+
+  bool add(
+      const std::string &id,
+      const std::string &title,
+      std::function<void(std::shared_ptr<web_socket_session_interface>)>
+          on_connected_func) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return targets_.emplace(id, target{title, on_connected_func, {}}).second;
+  }
+
+  // Returns the sessions of the target which are still alive.
+  std::vector<std::shared_ptr<ws_session>> remove(const std::string &id) {
+    std::vector<std::shared_ptr<ws_session>> sessions;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = targets_.find(id);
+    if (it == targets_.end())
+      return sessions;
+
+    for (auto &session : it->second.sessions) {
+      if (auto alive = session.lock())
+        sessions.push_back(std::move(alive));
+    }
+    targets_.erase(it);
+    return sessions;
+  }
+
+  bool route(
+      const std::string &path,
+      const std::shared_ptr<ws_session> &session) override {
+    if (path.compare(0, DEVTOOLS_PAGE_PATH.size(), DEVTOOLS_PAGE_PATH) != 0)
+      return false;
+
+    std::function<void(std::shared_ptr<web_socket_session_interface>)>
+        on_connected_func;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = targets_.find(path.substr(DEVTOOLS_PAGE_PATH.size()));
+      if (it == targets_.end())
+        return false;
+
+      auto &sessions = it->second.sessions;
+      sessions.erase(
+          std::remove_if(
+              sessions.begin(),
+              sessions.end(),
+              [](const std::weak_ptr<ws_session> &s) { return s.expired(); }),
+          sessions.end());
+      sessions.push_back(session);
+      on_connected_func = it->second.on_connected_func;
+    }
+
+    // Outside the lock, the target may well add or remove other targets. It
+    // can't be removed meanwhile, remove_target waits on the session's strand.
+    on_connected_func(session);
+    return true;
+  }
+
+  // The endpoints of the DevTools HTTP protocol that discovery, e.g. from
+  // chrome://inspect, relies on.
+  bool describe(
+      const std::string &path,
+      const std::string &host,
+      std::string &body) override {
+    std::string address =
+        is_host(host) ? host : "localhost:" + std::to_string(port_);
+
+    if (path == "/json/version") {
+      body = "{\"Browser\": \"hermesw\", \"Protocol-Version\": \"1.3\"}";
+      return true;
+    }
+
+    if (path != "/json" && path != "/json/list")
+      return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    body = "[";
+    for (auto &entry : targets_) {
+      std::string id = json_escape(entry.first);
+      std::string url = address + DEVTOOLS_PAGE_PATH + id;
+      if (body.size() > 1)
+        body += ",";
+      body += "{\"description\": \"hermesw\", ";
+      body += "\"devtoolsFrontendUrl\": \"devtools://devtools/bundled/"
+              "js_app.html?experiments=true&v8only=true&ws=" +
+          url + "\", ";
+      body += "\"id\": \"" + id + "\", ";
+      body += "\"title\": \"" + json_escape(entry.second.title) + "\", ";
+      body += "\"type\": \"node\", ";
+      body += "\"webSocketDebuggerUrl\": \"ws://" + url + "\"}";
+    }
+    body += "]";
+    return true;
+  }
+};
+
+// One io_context run by a pool of threads. Sessions are confined to their own
+// strands, so any thread can run any of them, and a handful of threads serve
+// however many targets and sessions.
+class shared_web_socket_server : public web_socket_server_interface {
+  boost::asio::io_context ioc_;
+  boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
+      work_;
+  std::shared_ptr<target_registry> registry_;
+  std::shared_ptr<listener> listener_;
+  std::vector<std::thread> threads_;
+
+ public:
+  shared_web_socket_server(
+      unsigned short port,
+      size_t thread_count,
+      const web_socket_options &options)
+      : ioc_(static_cast<int>(thread_count)),
+        work_(boost::asio::make_work_guard(ioc_)),
+        registry_(std::make_shared<target_registry>(port)) {
+    listener_ = std::make_shared<listener>(
+        ioc_,
+        tcp::endpoint{boost::asio::ip::make_address("0.0.0.0"), port},
+        options,
+        registry_);
+    if (!listener_->listening())
+      return;
+
+    listener_->run();
+    for (size_t i = 0; i < thread_count; i++) {
+      threads_.emplace_back([this]() { ioc_.run(); });
+    }
+  }
+
+  ~shared_web_socket_server() {
+    work_.reset();
+    ioc_.stop();
+    for (auto &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  bool running() const {
+    return !threads_.empty();
+  }
+
+  bool add_target(
+      const std::string &id,
+      const std::string &title,
+      std::function<void(std::shared_ptr<web_socket_session_interface>)>
+          on_connected_func) override {
+    return registry_->add(id, title, on_connected_func);
+  }
+
+  void remove_target(const std::string &id) override {
+    auto sessions = registry_->remove(id);
+
+    std::mutex mutex;
+    std::condition_variable detached;
+    size_t pending = sessions.size();
+    for (auto &session : sessions) {
+      session->detach([&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0)
+          detached.notify_all();
+      });
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    detached.wait(lock, [&]() { return pending == 0; });
+  }
+};
+
+std::shared_ptr<web_socket_server_interface> create_shared_web_socket_server(
+    unsigned short port,
+    size_t thread_count,
+    const web_socket_options &options) {
+  auto server = std::make_shared<shared_web_socket_server>(
+      port, std::max<size_t>(thread_count, 1), options);
+  if (!server->running())
+    return nullptr;
+
+  return server;
+}
+
 void create_web_socket_server(
     unsigned short port,
     std::function<void(std::shared_ptr<web_socket_session_interface>)>
         on_connected_func) {
+  create_web_socket_server(port, web_socket_options{}, on_connected_func);
+}
+
+void create_web_socket_server(
+    unsigned short port,
+    const web_socket_options &options,
+    std::function<void(std::shared_ptr<web_socket_session_interface>)>
+        on_connected_func) {
   boost::asio::io_context ioc;
   std::make_shared<listener>(
       ioc,
       tcp::endpoint{boost::asio::ip::make_address("0.0.0.0"), port},
+      options,
       on_connected_func)
       ->run();
   ioc.run();
@@ -294,9 +1108,17 @@ void create_web_socket_client(
     unsigned short port,
     std::function<void(std::shared_ptr<web_socket_session_interface>)>
         on_connected_func) {
+  create_web_socket_client(port, web_socket_options{}, on_connected_func);
+}
+
+void create_web_socket_client(
+    unsigned short port,
+    const web_socket_options &options,
+    std::function<void(std::shared_ptr<web_socket_session_interface>)>
+        on_connected_func) {
   boost::asio::io_context ioc;
-  std::make_shared<ws_session>(ioc, on_connected_func)
-      ->run_client("127.0.0.1", "8888");
+  std::make_shared<ws_session>(ioc, options, on_connected_func)
+      ->run_client("127.0.0.1", std::to_string(port).c_str());
   ioc.run();
 }
 
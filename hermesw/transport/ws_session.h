@@ -1,13 +1,58 @@
 #pragma once
 
+#include <chrono>
+#include <cstddef>
 #include <string>
 #include <functional>
+#include <memory>
 
 struct web_socket_session_interface {
   virtual void write(std::string text) = 0;
+  // Messages are moved into the callback, which can move them on in turn.
   virtual void setOnRead(std::function<void(std::string)>) = 0;
+  // Called once the session is over, whichever side ended it or if it failed.
+  // The read callback is never called after it.
+  virtual void setOnClose(std::function<void()>) = 0;
   virtual void close() = 0;
 };
 
+struct web_socket_options {
+  // Messages written in a burst go out in batches of up to this many bytes,
+  // each message still a frame of its own, with a single write per batch.
+  size_t max_batch_bytes = 64 * 1024;
+  // How long a message may wait for others to batch with. With zero, a batch
+  // is whatever was written by the end of the current io_context turn.
+  std::chrono::milliseconds max_batch_latency{0};
+
+  // Negotiate permessage-deflate, offered by clients and accepted by servers.
+  // Either side can still decline it.
+  bool deflate = false;
+  // Size of the LZ77 window, 9 to 15, values outside are clamped. Smaller
+  // windows take less memory per connection and compress somewhat worse.
+  int deflate_window_bits = 15;
+  // Messages smaller than this aren't worth compressing and are sent as is.
+  // Needs Boost 1.76 or later, older versions compress every message.
+  size_t deflate_min_size = 1024;
+};
+
+// Websocket server for any number of targets on a single port, run by a pool
+// of threads. A client connecting to /devtools/page/<id> is handed to the
+// target added under that id, and /json/list lists the targets, the way Chrome
+// DevTools discovers them. The server must not be released from one of its own
+// threads, i.e. from a session callback.
+struct web_socket_server_interface {
+  virtual ~web_socket_server_interface() = default;
+  // Returns false if the id is taken.
+  virtual bool add_target(const std::string &id, const std::string &title, std::function<void(std::shared_ptr<web_socket_session_interface>)> on_connected_func) = 0;
+  // Closes the target's sessions and waits until none of them calls into the
+  // target anymore, so must not be called from a session callback either.
+  virtual void remove_target(const std::string &id) = 0;
+};
+
+// Starts serving before returning. Returns nullptr if the port can't be bound.
+std::shared_ptr<web_socket_server_interface> create_shared_web_socket_server(unsigned short port, size_t thread_count, const web_socket_options &options);
+
+void create_web_socket_server(unsigned short port, const web_socket_options &options, std::function<void(std::shared_ptr<web_socket_session_interface>)> on_connected_func);
+void create_web_socket_client(unsigned short port, const web_socket_options &options, std::function<void(std::shared_ptr<web_socket_session_interface>)> on_connected_func);
 void create_web_socket_server(unsigned short port, std::function<void(std::shared_ptr<web_socket_session_interface>)> on_connected_func);
 void create_web_socket_client(unsigned short port, std::function<void(std::shared_ptr<web_socket_session_interface>)> on_connected_func);
\ No newline at end of file
@@ -1,8 +1,36 @@
 #include "pch.h"
 
 #include "BaseScriptStoreImpl.h"
-
+#include "Crc32c.h"
+
+#include <jsi/ScriptHash.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_set>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
 namespace facebook {
 namespace react {
@@ -52,7 +80,7 @@ class BufferViewBuffer : public facebook::jsi::Buffer {
   }
 
   BufferViewBuffer(
-      std::unique_ptr<const facebook::jsi::Buffer> buffer,
+      std::shared_ptr<const facebook::jsi::Buffer> buffer,
       size_t offset,
       size_t size)
       : buffer_(std::move(buffer)), offset_(offset), size_(size) {
@@ -67,11 +95,394 @@ class BufferViewBuffer : public facebook::jsi::Buffer {
   BufferViewBuffer(const BufferViewBuffer &) = delete;
   BufferViewBuffer &operator=(const BufferViewBuffer &) = delete;
 
-  std::unique_ptr<const facebook::jsi::Buffer> buffer_;
+  std::shared_ptr<const facebook::jsi::Buffer> buffer_;
   size_t offset_;
   size_t size_;
 };
 
+// Read-only view over a whole file mapped into memory. The mapping is released
+// when the buffer goes away.
+class MemoryMappedBuffer : public facebook::jsi::Buffer {
+ public:
+  size_t size() const override {
+    return size_;
+  }
+
+  const uint8_t *data() const override {
+    return data_;
+  }
+
+  static std::unique_ptr<const MemoryMappedBuffer> open(
+      const std::string &path) noexcept {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      return nullptr;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+      CloseHandle(file);
+      return nullptr;
+    }
+
+    HANDLE mapping =
+        CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    // The mapping object keeps the file open.
+    CloseHandle(file);
+    if (!mapping)
+      return nullptr;
+
+    void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    // The view keeps the mapping object alive.
+    CloseHandle(mapping);
+    if (!view)
+      return nullptr;
+
+    return std::unique_ptr<const MemoryMappedBuffer>(new MemoryMappedBuffer(
+        static_cast<const uint8_t *>(view),
+        static_cast<size_t>(fileSize.QuadPart)));
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      return nullptr;
+    }
+
+    void *view = mmap(
+        nullptr,
+        static_cast<size_t>(st.st_size),
+        PROT_READ,
+        MAP_SHARED,
+        fd,
+        0);
+    // The mapping keeps the file open.
+    ::close(fd);
+    if (view == MAP_FAILED)
+      return nullptr;
+
+    return std::unique_ptr<const MemoryMappedBuffer>(new MemoryMappedBuffer(
+        static_cast<const uint8_t *>(view), static_cast<size_t>(st.st_size)));
+#endif
+  }
+
+  ~MemoryMappedBuffer() {
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+#else
+    munmap(const_cast<uint8_t *>(data_), size_);
+#endif
+  }
+
+ private:
+  MemoryMappedBuffer(const uint8_t *data, size_t size)
+      : data_(data), size_(size) {}
+
+  MemoryMappedBuffer(const MemoryMappedBuffer &) = delete;
+  MemoryMappedBuffer &operator=(const MemoryMappedBuffer &) = delete;
+
+  const uint8_t *data_;
+  size_t size_;
+};
+
+// Unique per writer, so that concurrent writers of the same buffer, be it
+// threads or processes, never share a temporary file.
+std::string makeTempFilePath(const std::string &path) {
+  static std::atomic<uint32_t> counter{0};
+#ifdef _WIN32
+  unsigned long pid = GetCurrentProcessId();
+#else
+  unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+  return path + ".tmp." + std::to_string(pid) + "." +
+      std::to_string(counter++);
+}
+
+#ifdef _WIN32
+using FileHandle = HANDLE;
+#else
+using FileHandle = int;
+#endif
+
+bool writeSpans(
+    FileHandle file,
+    const std::vector<BufferSpan> &spans) noexcept {
+#ifdef _WIN32
+  bool ok = true;
+  for (const BufferSpan &span : spans) {
+    const uint8_t *data = span.data;
+    size_t remaining = span.size;
+    while (ok && remaining > 0) {
+      DWORD written = 0;
+      ok = WriteFile(
+               file,
+               data,
+               static_cast<DWORD>(std::min<size_t>(remaining, 1u << 30)),
+               &written,
+               nullptr) &&
+          written > 0;
+      data += written;
+      remaining -= written;
+    }
+  }
+  return ok;
+#else
+  std::vector<iovec> iov;
+  iov.reserve(spans.size());
+  for (const BufferSpan &span : spans) {
+    if (span.size > 0)
+      iov.push_back({const_cast<uint8_t *>(span.data), span.size});
+  }
+
+  size_t index = 0;
+  while (index < iov.size()) {
+    ssize_t written = writev(
+        file,
+        iov.data() + index,
+        static_cast<int>(std::min<size_t>(iov.size() - index, IOV_MAX)));
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+
+    // A short write can stop in the middle of a span.
+    size_t remaining = static_cast<size_t>(written);
+    while (remaining > 0 && remaining >= iov[index].iov_len) {
+      remaining -= iov[index].iov_len;
+      index++;
+    }
+    if (remaining > 0) {
+      iov[index].iov_base = static_cast<uint8_t *>(iov[index].iov_base) +
+          remaining;
+      iov[index].iov_len -= remaining;
+    }
+  }
+  return true;
+#endif
+}
+
+bool writeSpansToFile(
+    const std::string &path,
+    const std::vector<BufferSpan> &spans) noexcept {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(
+      path.c_str(),
+      GENERIC_WRITE,
+      0,
+      nullptr,
+      CREATE_ALWAYS,
+      FILE_ATTRIBUTE_NORMAL,
+      nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  bool ok = writeSpans(file, spans);
+
+  // Make sure the data is on disk before the rename can make it visible.
+  if (ok && !FlushFileBuffers(file))
+    ok = false;
+  if (!CloseHandle(file))
+    ok = false;
+  return ok;
+#else
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+
+  bool ok = writeSpans(fd, spans);
+
+  // Make sure the data is on disk before the rename can make it visible.
+  if (ok && fsync(fd) != 0)
+    ok = false;
+  if (::close(fd) != 0)
+    ok = false;
+  return ok;
+#endif
+}
+
+bool seekFile(FileHandle file, uint64_t offset) noexcept {
+#ifdef _WIN32
+  LARGE_INTEGER distance;
+  distance.QuadPart = static_cast<LONGLONG>(offset);
+  return SetFilePointerEx(file, distance, nullptr, FILE_BEGIN) != 0;
+#else
+  return lseek(file, static_cast<off_t>(offset), SEEK_SET) ==
+      static_cast<off_t>(offset);
+#endif
+}
+
+// Spans to write at an offset of a file.
+struct FileWrite {
+  uint64_t offset;
+  std::vector<BufferSpan> spans;
+};
+
+// Called with the append lock held and the size of the file. Can fail the
+// append, or ask for writes to be made before it.
+using AppendPreparer =
+    std::function<bool(uint64_t fileSize, std::vector<FileWrite> &writes)>;
+
+bool appendSpansLocked(
+    FileHandle file,
+    uint64_t fileSize,
+    const std::vector<BufferSpan> &spans,
+    const AppendPreparer &prepare,
+    uint64_t &offset) noexcept {
+  std::vector<FileWrite> writes;
+  if (!prepare(fileSize, writes))
+    return false;
+
+  offset = fileSize;
+  for (const FileWrite &write : writes) {
+    if (!seekFile(file, write.offset) || !writeSpans(file, write.spans))
+      return false;
+
+    uint64_t end = write.offset;
+    for (const BufferSpan &span : write.spans) {
+      end += span.size;
+    }
+    offset = std::max(offset, end);
+  }
+
+  return seekFile(file, offset) && writeSpans(file, spans);
+}
+
+// Appends the spans to an existing file as a single record. Appends are
+// serialized with an exclusive lock, so that records written concurrently by
+// several processes never interleave. prepare runs under the lock, e.g. to
+// step over a record torn by a crash; the spans go after whatever it writes.
+// offset is set to where the spans went.
+bool appendSpansToFile(
+    const std::string &path,
+    const std::vector<BufferSpan> &spans,
+    const AppendPreparer &prepare,
+    uint64_t &offset) noexcept {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(
+      path.c_str(),
+      GENERIC_WRITE,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+      nullptr,
+      OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL,
+      nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  // Byte range locks are mandatory on Windows, so lock a range way past the
+  // end of the file where no reader ever looks.
+  OVERLAPPED lockRange = {};
+  lockRange.Offset = MAXDWORD;
+  lockRange.OffsetHigh = MAXLONG;
+  if (!LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &lockRange)) {
+    CloseHandle(file);
+    return false;
+  }
+
+  LARGE_INTEGER fileSize;
+  bool ok = GetFileSizeEx(file, &fileSize) &&
+      appendSpansLocked(
+                file,
+                static_cast<uint64_t>(fileSize.QuadPart),
+                spans,
+                prepare,
+                offset);
+  if (ok && !FlushFileBuffers(file))
+    ok = false;
+
+  UnlockFileEx(file, 0, 1, 0, &lockRange);
+  if (!CloseHandle(file))
+    ok = false;
+  return ok;
+#else
+  // Not O_APPEND, prepare's writes go anywhere in the file.
+  int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  int locked;
+  do {
+    locked = flock(fd, LOCK_EX);
+  } while (locked != 0 && errno == EINTR);
+  if (locked != 0) {
+    ::close(fd);
+    return false;
+  }
+
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0 &&
+      appendSpansLocked(
+                fd, static_cast<uint64_t>(st.st_size), spans, prepare, offset);
+  if (ok && fsync(fd) != 0)
+    ok = false;
+
+  // Closing the file releases the lock.
+  if (::close(fd) != 0)
+    ok = false;
+  return ok;
+#endif
+}
+
+uint64_t getFileSize(const std::string &path) noexcept {
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA attributes;
+  if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes))
+    return 0;
+  return (static_cast<uint64_t>(attributes.nFileSizeHigh) << 32) |
+      attributes.nFileSizeLow;
+#else
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return 0;
+  return static_cast<uint64_t>(st.st_size);
+#endif
+}
+
+bool replaceFile(const std::string &from, const std::string &to) noexcept {
+#ifdef _WIN32
+  return MoveFileExA(
+             from.c_str(),
+             to.c_str(),
+             MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+  return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// Like replaceFile, but fails if the target already exists, in which case the
+// source is left alone.
+bool moveFileIfAbsent(const std::string &from, const std::string &to) noexcept {
+#ifdef _WIN32
+  return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_WRITE_THROUGH) != 0;
+#else
+  if (link(from.c_str(), to.c_str()) != 0)
+    return false;
+  std::remove(from.c_str());
+  return true;
+#endif
+}
+
+// Persist the directory entry created by a rename.
+void syncDirectory(const std::string &directory) noexcept {
+#ifndef _WIN32
+  int fd = ::open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    fsync(fd);
+    ::close(fd);
+  }
+#endif
+}
+
 constexpr const char *PERSIST_MAGIC = "RNWPREP";
 constexpr const char *PERSIST_EOF = "EOF";
 
@@ -79,10 +490,33 @@ int constexpr length__(const char *str) {
   return *str ? 1 + length__(str + 1) : 0;
 }
 
-// TODO : Enforce any packing policy ?
+// Version 1 had no formatVersion (it was padding and always 0), no checksums
+// and no block table. Version 2 had a single checksum of the whole payload.
+constexpr uint8_t PERSIST_FORMAT_VERSION = 3;
+
+// Granularity at which the payload is checksummed, so that it can be verified
+// piecemeal instead of up front.
+constexpr uint32_t PERSIST_BLOCK_SIZE = 64 * 1024;
+
+// The prepared script file layout is fixed regardless of the compiler and the
+// host: structs are packed and multi-byte fields are stored little endian.
+//
+// The file is laid out as
+//   PreparedScriptPrefix
+//   uint32_t blockChecksums[blockCount], zero padded to a multiple of 8 bytes
+//   payload (sizeInBytes bytes)
+//   PreparedScriptSuffix
+// where blockChecksums[i] is the CRC32C of the i-th blockSize bytes of the
+// payload.
+#pragma pack(push, 1)
 struct PreparedScriptPrefix {
   // TODO :: constexpr initialize the array.
   char magic[length__(PERSIST_MAGIC)];
+  uint8_t formatVersion;
+  // CRC32C of the prefix, with this field set to 0, followed by the block
+  // checksum table.
+  uint32_t headerChecksum;
+  uint32_t blockSize;
   jsi::ScriptVersion_t scriptVersion;
   jsi::JSRuntimeVersion_t runtimeVersion;
   uint64_t sizeInBytes;
@@ -91,15 +525,222 @@ struct PreparedScriptPrefix {
 struct PreparedScriptSuffix {
   char eof[length__(PERSIST_EOF)];
 };
+#pragma pack(pop)
 
-} // namespace
+static_assert(
+    sizeof(PreparedScriptPrefix) == 40,
+    "Prepared script prefix layout changed, bump PERSIST_FORMAT_VERSION.");
 
-jsi::VersionedBuffer BaseScriptStoreImpl::getVersionedScript(
-    const std::string &url) noexcept {
-  std::ifstream file(url, std::ios::binary | std::ios::ate);
+// The payload is handed to the VM in place, straight out of the (page aligned)
+// mapping, and Hermes requires the bytecode to be suitably aligned.
+static_assert(
+    sizeof(PreparedScriptPrefix) % alignof(uint64_t) == 0,
+    "Prepared script payload must stay 8 byte aligned.");
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+uint32_t littleEndian(uint32_t value) {
+  return __builtin_bswap32(value);
+}
+
+uint64_t littleEndian(uint64_t value) {
+  return __builtin_bswap64(value);
+}
+#else
+uint32_t littleEndian(uint32_t value) {
+  return value;
+}
+
+uint64_t littleEndian(uint64_t value) {
+  return value;
+}
+#endif
+
+size_t getBlockCount(uint64_t sizeInBytes, uint32_t blockSize) {
+  return static_cast<size_t>((sizeInBytes + blockSize - 1) / blockSize);
+}
+
+// Keeps the payload which follows the table 8 byte aligned.
+size_t getBlockTableSize(size_t blockCount) {
+  return (blockCount * sizeof(uint32_t) + 7) & ~static_cast<size_t>(7);
+}
+
+uint32_t getHeaderChecksum(
+    const PreparedScriptPrefix &prefix,
+    const uint8_t *blockTable,
+    size_t blockTableSize) {
+  PreparedScriptPrefix copy = prefix;
+  copy.headerChecksum = 0;
+  return crc32c(
+      blockTable,
+      blockTableSize,
+      crc32c(reinterpret_cast<const uint8_t *>(&copy), sizeof(copy)));
+}
+
+bool verifyBlocks(
+    const uint8_t *payload,
+    size_t size,
+    uint32_t blockSize,
+    const uint32_t *blockChecksums) {
+  for (size_t offset = 0, block = 0; offset < size;
+       offset += blockSize, block++) {
+    uint32_t checksum =
+        crc32c(payload + offset, std::min<size_t>(blockSize, size - offset));
+    if (checksum != littleEndian(blockChecksums[block]))
+      return false;
+  }
+  return true;
+}
+
+// Lock files live in a directory of their own, one per slot of the hashed
+// buffer ids, so that there is a bounded number of them whatever the store
+// holds. Buffers sharing a slot contend for the same lock, which only makes a
+// preparation wait for another one now and then.
+constexpr const char *LOCK_DIRECTORY_NAME = "locks";
+constexpr uint64_t LOCK_FILE_COUNT = 256;
+
+// Buffer ids of the prepared scripts in the order they were first looked up,
+// one per line, after a version line.
+constexpr const char *LOAD_MANIFEST_ID = "load.manifest";
+constexpr const char *LOAD_MANIFEST_HEADER = "RNWLOAD 1\n";
+// Startup rarely needs more, and the manifest must not grow without bounds.
+constexpr size_t LOAD_MANIFEST_MAX_ENTRIES = 1024;
+
+constexpr const char *PACK_FILE_NAME = "buffers.pack";
+constexpr const char *PACK_MAGIC = "RNWPACK";
+constexpr uint32_t PACK_FORMAT_VERSION = 1;
+constexpr uint32_t PACK_RECORD_REMOVED = 1;
+// Covers bytes torn by a crash, so that the records after it can be found.
+constexpr uint32_t PACK_RECORD_PADDING = 2;
+
+// The pack file is laid out as
+//   PackHeader
+//   PackIndexEntry index[entryCount], sorted by keyHash
+//   indexed buffers, each zero padded to a multiple of 8 bytes
+//   records appended since the pack was last compacted, starting at
+//   appendOffset, each one a PackRecordHeader followed by the buffer, again
+//   zero padded to a multiple of 8 bytes
+// Everything stays 8 byte aligned, like the payload within a prepared script.
+#pragma pack(push, 1)
+struct PackHeader {
+  char magic[length__(PACK_MAGIC) + 1];
+  uint32_t formatVersion;
+  uint32_t entryCount;
+  uint64_t appendOffset;
+  // CRC32C of the header, with this field set to 0, followed by the index.
+  uint32_t headerChecksum;
+  uint32_t reserved;
+};
+
+struct PackIndexEntry {
+  uint64_t keyHash;
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct PackRecordHeader {
+  uint64_t keyHash;
+  uint64_t size;
+  uint32_t flags;
+  // CRC32C of the record header, with this field set to 0.
+  uint32_t checksum;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(PackHeader) == 32, "Pack header layout changed.");
+static_assert(sizeof(PackIndexEntry) == 24, "Pack index layout changed.");
+static_assert(sizeof(PackRecordHeader) == 24, "Pack record layout changed.");
+
+uint64_t alignPackOffset(uint64_t offset) {
+  return (offset + 7) & ~static_cast<uint64_t>(7);
+}
+
+uint64_t getPackKeyHash(const std::string &bufferId) {
+  return jsi::xxhash64(
+      reinterpret_cast<const uint8_t *>(bufferId.data()), bufferId.size());
+}
+
+uint32_t getPackHeaderChecksum(
+    const PackHeader &header,
+    const uint8_t *index,
+    size_t indexSize) {
+  PackHeader copy = header;
+  copy.headerChecksum = 0;
+  return crc32c(
+      index,
+      indexSize,
+      crc32c(reinterpret_cast<const uint8_t *>(&copy), sizeof(copy)));
+}
+
+uint32_t getPackRecordChecksum(const PackRecordHeader &record) {
+  PackRecordHeader copy = record;
+  copy.checksum = 0;
+  return crc32c(reinterpret_cast<const uint8_t *>(&copy), sizeof(copy));
+}
+
+PackRecordHeader
+makePackRecordHeader(uint64_t keyHash, uint64_t size, uint32_t flags) {
+  PackRecordHeader record = {};
+  record.keyHash = littleEndian(keyHash);
+  record.size = littleEndian(size);
+  record.flags = littleEndian(flags);
+  record.checksum = littleEndian(getPackRecordChecksum(record));
+  return record;
+}
+
+PackHeader makePackHeader(
+    uint32_t entryCount,
+    uint64_t appendOffset,
+    const uint8_t *index,
+    size_t indexSize) {
+  PackHeader header = {};
+  memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+  header.formatVersion = littleEndian(PACK_FORMAT_VERSION);
+  header.entryCount = littleEndian(entryCount);
+  header.appendOffset = littleEndian(appendOffset);
+  header.headerChecksum =
+      littleEndian(getPackHeaderChecksum(header, index, indexSize));
+  return header;
+}
+
+// Remembers the version of a script, in the version cache directory, as
+//   ScriptVersionRecord
+// with the stamp of the script when it was hashed. The file is named after a
+// hash of the url, as the url may not make a valid file name.
+constexpr const char *SCRIPT_VERSION_FILE_PREFIX = "script-";
+constexpr const char *SCRIPT_VERSION_FILE_SUFFIX = ".version";
+constexpr const char *SCRIPT_VERSION_MAGIC = "RNWVERS";
+constexpr uint32_t SCRIPT_VERSION_FORMAT_VERSION = 1;
+
+#pragma pack(push, 1)
+struct ScriptVersionRecord {
+  char magic[length__(SCRIPT_VERSION_MAGIC) + 1];
+  uint32_t formatVersion;
+  // CRC32C of the record, with this field set to 0.
+  uint32_t checksum;
+  uint64_t device;
+  uint64_t fileId;
+  uint64_t size;
+  uint64_t modified;
+  uint64_t changed;
+  uint64_t version;
+};
+#pragma pack(pop)
+
+static_assert(
+    sizeof(ScriptVersionRecord) == 64,
+    "Script version record layout changed.");
+
+uint32_t getScriptVersionRecordChecksum(const ScriptVersionRecord &record) {
+  ScriptVersionRecord copy = record;
+  copy.checksum = 0;
+  return crc32c(reinterpret_cast<const uint8_t *>(&copy), sizeof(copy));
+}
+
+std::unique_ptr<ByteArrayBuffer> readFile(const std::string &path) noexcept {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
 
   if (!file) {
-    return {nullptr, 0};
+    return nullptr;
   }
 
   std::streamsize size = file.tellg();
@@ -107,32 +748,315 @@ jsi::VersionedBuffer BaseScriptStoreImpl::getVersionedScript(
 
   auto buffer = std::make_unique<ByteArrayBuffer>(static_cast<size_t>(size));
   if (!file.read(reinterpret_cast<char *>(buffer->data()), size)) {
+    return nullptr;
+  }
+
+  return buffer;
+}
+
+} // namespace
+
+// Verifies the payload of prepared scripts on a background thread, after they
+// have been handed out. A prepared script which fails verification is dropped
+// from the store, so that it gets regenerated. The runtime which already got
+// it is on its own.
+class BasePreparedScriptStoreImpl::BackgroundVerifier {
+ public:
+  struct Job {
+    std::string bufferId;
+    // Keeps the mapping alive.
+    std::shared_ptr<const jsi::Buffer> payload;
+    uint32_t blockSize;
+    std::vector<uint32_t> blockChecksums;
+  };
+
+  BackgroundVerifier(std::shared_ptr<BufferStore> bufferStore)
+      : bufferStore_(std::move(bufferStore)),
+        thread_(&BackgroundVerifier::run, this) {}
+
+  // Pending jobs are dropped, the next load will verify again.
+  ~BackgroundVerifier() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  void enqueue(Job job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(job));
+    }
+    cv_.notify_one();
+  }
+
+  // Whether the buffer failed verification earlier in this process. It may
+  // not have been possible to remove it, e.g. if it is still mapped on Windows.
+  bool isCorrupted(const std::string &bufferId) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return corrupted_.count(bufferId) != 0;
+  }
+
+  // The buffer has been rewritten.
+  void forgetCorrupted(const std::string &bufferId) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    corrupted_.erase(bufferId);
+  }
+
+ private:
+  void run() {
+    while (true) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (stopping_)
+        return;
+
+      Job job = std::move(queue_.front());
+      queue_.pop_front();
+      lock.unlock();
+
+      if (!verifyBlocks(
+              job.payload->data(),
+              job.payload->size(),
+              job.blockSize,
+              job.blockChecksums.data())) {
+        lock.lock();
+        corrupted_.insert(job.bufferId);
+        lock.unlock();
+
+        bufferStore_->removeBuffer(job.bufferId);
+      }
+    }
+  }
+
+  std::shared_ptr<BufferStore> bufferStore_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job> queue_;
+  std::unordered_set<std::string> corrupted_;
+  bool stopping_{false};
+
+  std::thread thread_;
+};
+
+/*static*/ bool BaseScriptStoreImpl::getFileStamp(
+    const std::string &path,
+    FileStamp &stamp) noexcept {
+  // Changes less than this apart may share a modification or change time,
+  // depending on the file system.
+  constexpr int64_t SETTLE_SECONDS = 2;
+#ifdef _WIN32
+  HANDLE file = CreateFileA(
+      path.c_str(),
+      FILE_READ_ATTRIBUTES,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+      nullptr,
+      OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL,
+      nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  BY_HANDLE_FILE_INFORMATION information;
+  FILE_BASIC_INFO basic;
+  bool stamped = GetFileInformationByHandle(file, &information) &&
+      GetFileInformationByHandleEx(file, FileBasicInfo, &basic, sizeof(basic));
+  CloseHandle(file);
+  if (!stamped)
+    return false;
+
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  // FILETIMEs count 100ns intervals.
+  int64_t nowTicks = static_cast<int64_t>(
+      (static_cast<uint64_t>(now.dwHighDateTime) << 32) | now.dwLowDateTime);
+
+  stamp.device = information.dwVolumeSerialNumber;
+  stamp.fileId = (static_cast<uint64_t>(information.nFileIndexHigh) << 32) |
+      information.nFileIndexLow;
+  stamp.size = (static_cast<uint64_t>(information.nFileSizeHigh) << 32) |
+      information.nFileSizeLow;
+  stamp.modified = basic.LastWriteTime.QuadPart;
+  stamp.changed = basic.ChangeTime.QuadPart;
+  stamp.settled = std::max(stamp.modified, stamp.changed) +
+          SETTLE_SECONDS * 10000000 <
+      nowTicks;
+#else
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return false;
+
+#ifdef __APPLE__
+  const struct timespec &modified = st.st_mtimespec;
+  const struct timespec &changed = st.st_ctimespec;
+#else
+  const struct timespec &modified = st.st_mtim;
+  const struct timespec &changed = st.st_ctim;
+#endif
+  stamp.device = static_cast<uint64_t>(st.st_dev);
+  stamp.fileId = static_cast<uint64_t>(st.st_ino);
+  stamp.size = static_cast<uint64_t>(st.st_size);
+  stamp.modified =
+      static_cast<int64_t>(modified.tv_sec) * 1000000000 + modified.tv_nsec;
+  stamp.changed =
+      static_cast<int64_t>(changed.tv_sec) * 1000000000 + changed.tv_nsec;
+  stamp.settled = std::max(modified.tv_sec, changed.tv_sec) + SETTLE_SECONDS <
+      time(nullptr);
+#endif
+  return true;
+}
+
+std::string BaseScriptStoreImpl::getVersionFilePath(
+    const std::string &url) const {
+  char urlHashHex[17];
+  snprintf(
+      urlHashHex,
+      sizeof(urlHashHex),
+      "%016" PRIx64,
+      jsi::xxhash64(reinterpret_cast<const uint8_t *>(url.data()), url.size()));
+  return versionCacheDirectory_ + SCRIPT_VERSION_FILE_PREFIX + urlHashHex +
+      SCRIPT_VERSION_FILE_SUFFIX;
+}
+
+bool BaseScriptStoreImpl::getCachedVersion(
+    const std::string &url,
+    const FileStamp &stamp,
+    jsi::ScriptVersion_t &version) noexcept {
+  {
+    std::lock_guard<std::mutex> lock(versionsMutex_);
+    auto cached = versions_.find(url);
+    if (cached != versions_.end() && cached->second.stamp == stamp) {
+      version = cached->second.version;
+      return true;
+    }
+  }
+
+  if (versionCacheDirectory_.empty())
+    return false;
+
+  std::ifstream file(getVersionFilePath(url), std::ios::binary);
+  ScriptVersionRecord record;
+  if (!file.read(reinterpret_cast<char *>(&record), sizeof(record)) ||
+      memcmp(record.magic, SCRIPT_VERSION_MAGIC, sizeof(record.magic)) != 0 ||
+      littleEndian(record.formatVersion) != SCRIPT_VERSION_FORMAT_VERSION ||
+      littleEndian(record.checksum) !=
+          getScriptVersionRecordChecksum(record) ||
+      littleEndian(record.device) != stamp.device ||
+      littleEndian(record.fileId) != stamp.fileId ||
+      littleEndian(record.size) != stamp.size ||
+      static_cast<int64_t>(littleEndian(record.modified)) != stamp.modified ||
+      static_cast<int64_t>(littleEndian(record.changed)) != stamp.changed ||
+      record.version == 0) {
+    return false;
+  }
+
+  version = littleEndian(record.version);
+
+  std::lock_guard<std::mutex> lock(versionsMutex_);
+  versions_[url] = {stamp, version};
+  return true;
+}
+
+void BaseScriptStoreImpl::cacheVersion(
+    const std::string &url,
+    const FileStamp &stamp,
+    jsi::ScriptVersion_t version) noexcept {
+  // The script may still be changing, without its stamp changing along.
+  if (!stamp.settled)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(versionsMutex_);
+    versions_[url] = {stamp, version};
+  }
+
+  if (versionCacheDirectory_.empty())
+    return;
+
+  ScriptVersionRecord record = {};
+  memcpy(record.magic, SCRIPT_VERSION_MAGIC, sizeof(record.magic));
+  record.formatVersion = littleEndian(SCRIPT_VERSION_FORMAT_VERSION);
+  record.device = littleEndian(stamp.device);
+  record.fileId = littleEndian(stamp.fileId);
+  record.size = littleEndian(stamp.size);
+  record.modified = littleEndian(static_cast<uint64_t>(stamp.modified));
+  record.changed = littleEndian(static_cast<uint64_t>(stamp.changed));
+  record.version = littleEndian(static_cast<uint64_t>(version));
+  record.checksum = littleEndian(getScriptVersionRecordChecksum(record));
+
+  // Best effort, the version is only hashed again if this fails.
+  std::string path = getVersionFilePath(url);
+  std::string tempPath = makeTempFilePath(path);
+  if (!writeSpansToFile(
+          tempPath,
+          {{reinterpret_cast<const uint8_t *>(&record), sizeof(record)}}) ||
+      !replaceFile(tempPath, path)) {
+    std::remove(tempPath.c_str());
+  }
+}
+
+jsi::VersionedBuffer BaseScriptStoreImpl::getVersionedScript(
+    const std::string &url) noexcept {
+  FileStamp stamp;
+  bool stamped = !versionProvider_ && getFileStamp(url, stamp);
+
+  std::unique_ptr<ByteArrayBuffer> buffer = readFile(url);
+  if (!buffer) {
     return {nullptr, 0};
   }
 
-  file.close();
+  if (versionProvider_) {
+    return {std::move(buffer), versionProvider_->getVersion(url)};
+  }
+
+  // The version getScriptVersion just computed, when the script wasn't found
+  // in the prepared script store, is reused unless the file changed while it
+  // was being read.
+  FileStamp after;
+  bool unchanged = stamped && getFileStamp(url, after) && after == stamp;
+
+  jsi::ScriptVersion_t version;
+  if (!unchanged || !getCachedVersion(url, stamp, version)) {
+    version = jsi::computeScriptVersion(*buffer);
+    if (unchanged)
+      cacheVersion(url, stamp, version);
+  }
 
-  return {std::move(buffer),
-          versionProvider_ ? versionProvider_->getVersion(url)
-                           : static_cast<uint64_t>(size)};
+  return {std::move(buffer), version};
 }
 
 jsi::ScriptVersion_t BaseScriptStoreImpl::getScriptVersion(
     const std::string &url) noexcept {
   if (versionProvider_) {
     return versionProvider_->getVersion(url);
-  } else {
-    std::ifstream file(url, std::ios::binary | std::ios::ate);
+  }
 
-    if (!file) {
-      return 0;
-    }
+  FileStamp stamp;
+  if (!getFileStamp(url, stamp)) {
+    return 0;
+  }
 
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
+  jsi::ScriptVersion_t version;
+  if (getCachedVersion(url, stamp, version)) {
+    return version;
+  }
 
-    return static_cast<uint64_t>(size);
+  // Not seen yet, or changed since.
+  std::unique_ptr<ByteArrayBuffer> buffer = readFile(url);
+  if (!buffer) {
+    return 0;
   }
+
+  version = jsi::computeScriptVersion(*buffer);
+
+  FileStamp after;
+  if (getFileStamp(url, after) && after == stamp) {
+    cacheVersion(url, stamp, version);
+  }
+  return version;
 }
 
 std::unique_ptr<const jsi::Buffer> LocalFileSimpleBufferStore::getBuffer(
@@ -164,21 +1088,585 @@ std::unique_ptr<const jsi::Buffer> LocalFileSimpleBufferStore::getBuffer(
   return buffer;
 }
 
+std::unique_ptr<const jsi::Buffer> LocalFileMappedBufferStore::getBuffer(
+    const std::string &bufferId) noexcept {
+  // Assumptions on storeDirectory_ same as in LocalFileSimpleBufferStore
+  if (storeDirectory_.empty()) {
+    std::terminate();
+  }
+
+  return MemoryMappedBuffer::open(storeDirectory_ + bufferId);
+}
+
+bool BufferStore::persistBuffers(
+    const std::string &bufferId,
+    const std::vector<BufferSpan> &spans) noexcept {
+  size_t size = 0;
+  for (const BufferSpan &span : spans) {
+    size += span.size;
+  }
+
+  auto buffer = std::make_unique<ByteArrayBuffer>(size);
+  uint8_t *cursor = buffer->data();
+  for (const BufferSpan &span : spans) {
+    memcpy(cursor, span.data, span.size);
+    cursor += span.size;
+  }
+
+  return persistBuffer(bufferId, std::move(buffer));
+}
+
 bool LocalFileSimpleBufferStore::persistBuffer(
     const std::string &relativeUrl,
     std::unique_ptr<const jsi::Buffer> buffer) noexcept {
+  return persistBuffers(relativeUrl, {{buffer->data(), buffer->size()}});
+}
+
+bool LocalFileSimpleBufferStore::removeBuffer(
+    const std::string &relativeUrl) noexcept {
+  // Assumptions on storeDirectory_ same as in getRawBuffer
+  if (storeDirectory_.empty())
+    std::terminate();
+
+  return std::remove((storeDirectory_ + relativeUrl).c_str()) == 0;
+}
+
+void LocalFileSimpleBufferStore::prefetchBuffers(
+    const std::vector<std::string> &bufferIds) noexcept {
+  // Assumptions on storeDirectory_ same as in getRawBuffer
+  if (storeDirectory_.empty())
+    std::terminate();
+
+  std::vector<std::string> paths;
+  paths.reserve(bufferIds.size());
+  for (const std::string &bufferId : bufferIds) {
+    paths.push_back(storeDirectory_ + bufferId);
+  }
+
+  // Even issuing the readahead costs an open per file, keep it off the
+  // caller's thread.
+  try {
+    std::thread([paths = std::move(paths)]() {
+#ifdef _WIN32
+      // No fire and forget readahead for plain reads on Windows, reading the
+      // files once leaves them in the cache.
+      std::vector<uint8_t> scratch(1024 * 1024);
+      for (const std::string &path : paths) {
+        HANDLE file = CreateFileA(
+            path.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN,
+            nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+          continue;
+
+        DWORD read = 0;
+        while (ReadFile(
+                   file,
+                   scratch.data(),
+                   static_cast<DWORD>(scratch.size()),
+                   &read,
+                   nullptr) &&
+               read > 0) {
+        }
+        CloseHandle(file);
+      }
+#else
+      // The kernel queues the reads and returns right away, so all files are
+      // read in parallel.
+      for (const std::string &path : paths) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+          continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        ::close(fd);
+      }
+#endif
+    }).detach();
+  } catch (const std::system_error &) {
+    // It's only a hint.
+  }
+}
+
+bool LocalFileSimpleBufferStore::persistBuffers(
+    const std::string &relativeUrl,
+    const std::vector<BufferSpan> &spans) noexcept {
+  // Assumptions on storeDirectory_ same as in getRawBuffer
+  if (storeDirectory_.empty())
+    std::terminate();
+
+  std::string path = storeDirectory_ + relativeUrl;
+  std::string tempPath = makeTempFilePath(path);
+
+  if (!writeSpansToFile(tempPath, spans) || !replaceFile(tempPath, path)) {
+    std::remove(tempPath.c_str());
+    return false;
+  }
+
+  syncDirectory(storeDirectory_);
+  return true;
+}
+
+bool LocalFileSimpleBufferStore::tryLockBuffer(
+    const std::string &bufferId) noexcept {
   // Assumptions on storeDirectory_ same as in getRawBuffer
   if (storeDirectory_.empty())
     std::terminate();
 
-  std::ofstream file;
-  file.open(storeDirectory_ + relativeUrl, std::ios::binary | std::ios::trunc);
-  if (!file)
+  std::lock_guard<std::mutex> lock(locksMutex_);
+  if (locks_.count(bufferId))
+    return false;
+
+  std::string directory = storeDirectory_ + LOCK_DIRECTORY_NAME;
+  char fileName[16];
+  snprintf(
+      fileName,
+      sizeof(fileName),
+      "/%02" PRIx64 ".lock",
+      jsi::xxhash64(
+          reinterpret_cast<const uint8_t *>(bufferId.data()), bufferId.size()) %
+          LOCK_FILE_COUNT);
+  std::string path = directory + fileName;
+#ifdef _WIN32
+  CreateDirectoryA(directory.c_str(), nullptr);
+
+  // No sharing makes the open itself the lock. The file goes away with the
+  // last handle to it.
+  HANDLE file = CreateFileA(
+      path.c_str(),
+      GENERIC_READ | GENERIC_WRITE,
+      0,
+      nullptr,
+      OPEN_ALWAYS,
+      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE,
+      nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return GetLastError() != ERROR_SHARING_VIOLATION;
+
+  locks_.emplace(bufferId, reinterpret_cast<intptr_t>(file));
+#else
+  ::mkdir(directory.c_str(), 0755);
+
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    // Without a lock file there is nothing to coordinate on, don't hold up
+    // the caller for it.
+    return true;
+  }
+
+  int locked;
+  do {
+    locked = flock(fd, LOCK_EX | LOCK_NB);
+  } while (locked != 0 && errno == EINTR);
+  if (locked != 0) {
+    bool held = errno == EWOULDBLOCK;
+    ::close(fd);
+    return !held;
+  }
+
+  locks_.emplace(bufferId, fd);
+#endif
+  return true;
+}
+
+void LocalFileSimpleBufferStore::unlockBuffer(
+    const std::string &bufferId) noexcept {
+  std::lock_guard<std::mutex> lock(locksMutex_);
+  auto it = locks_.find(bufferId);
+  if (it == locks_.end())
+    return;
+
+  // Closing the file releases the lock.
+#ifdef _WIN32
+  CloseHandle(reinterpret_cast<HANDLE>(it->second));
+#else
+  ::close(static_cast<int>(it->second));
+#endif
+  locks_.erase(it);
+}
+
+PackFileBufferStore::PackFileBufferStore(const std::string &storeDirectory)
+    : packFilePath_(storeDirectory + PACK_FILE_NAME),
+      lockStore_(storeDirectory) {
+  // Assumptions on storeDirectory same as in LocalFileSimpleBufferStore
+  if (storeDirectory.empty())
+    std::terminate();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  remap();
+}
+
+bool PackFileBufferStore::remap() noexcept {
+  std::shared_ptr<const jsi::Buffer> pack =
+      MemoryMappedBuffer::open(packFilePath_);
+  if (!pack || pack->size() < sizeof(PackHeader))
+    return false;
+
+  // Unless the pack got compacted under us, only the tail can have changed.
+  if (!pack_ ||
+      memcmp(pack_->data(), pack->data(), sizeof(PackHeader)) != 0) {
+    const PackHeader *header =
+        reinterpret_cast<const PackHeader *>(pack->data());
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 ||
+        littleEndian(header->formatVersion) != PACK_FORMAT_VERSION) {
+      return false;
+    }
+
+    uint32_t entryCount = littleEndian(header->entryCount);
+    uint64_t appendOffset = littleEndian(header->appendOffset);
+    uint64_t indexSize =
+        static_cast<uint64_t>(entryCount) * sizeof(PackIndexEntry);
+    if (appendOffset > pack->size() ||
+        sizeof(PackHeader) + indexSize > appendOffset) {
+      return false;
+    }
+
+    if (getPackHeaderChecksum(
+            *header,
+            pack->data() + sizeof(PackHeader),
+            static_cast<size_t>(indexSize)) !=
+        littleEndian(header->headerChecksum)) {
+      return false;
+    }
+
+    indexedCount_ = entryCount;
+    scannedSize_ = appendOffset;
+    appended_.clear();
+  }
+
+  const uint8_t *data = pack->data();
+  uint64_t size = pack->size();
+  while (scannedSize_ + sizeof(PackRecordHeader) <= size) {
+    PackRecordHeader record;
+    memcpy(&record, data + scannedSize_, sizeof(record));
+    if (getPackRecordChecksum(record) != littleEndian(record.checksum)) {
+      // Torn by a crash, or being written. The next append covers it with a
+      // padding record if it's torn.
+      break;
+    }
+
+    uint64_t offset = scannedSize_ + sizeof(PackRecordHeader);
+    uint64_t recordSize = littleEndian(record.size);
+    if (recordSize > size - offset) {
+      // Still being written.
+      break;
+    }
+
+    uint32_t flags = littleEndian(record.flags);
+    if ((flags & PACK_RECORD_PADDING) == 0) {
+      appended_[littleEndian(record.keyHash)] = {
+          offset, recordSize, (flags & PACK_RECORD_REMOVED) != 0};
+    }
+    scannedSize_ = alignPackOffset(offset + recordSize);
+  }
+
+  pack_ = std::move(pack);
+  return true;
+}
+
+bool PackFileBufferStore::lookup(
+    uint64_t keyHash,
+    Location &location) noexcept {
+  if (!pack_)
+    return false;
+
+  auto appended = appended_.find(keyHash);
+  if (appended != appended_.end()) {
+    location = appended->second;
+    return true;
+  }
+
+  const PackIndexEntry *first = reinterpret_cast<const PackIndexEntry *>(
+      pack_->data() + sizeof(PackHeader));
+  const PackIndexEntry *last = first + indexedCount_;
+  const PackIndexEntry *entry = std::lower_bound(
+      first, last, keyHash, [](const PackIndexEntry &entry, uint64_t keyHash) {
+        return littleEndian(entry.keyHash) < keyHash;
+      });
+  if (entry == last || littleEndian(entry->keyHash) != keyHash)
+    return false;
+
+  location = {littleEndian(entry->offset), littleEndian(entry->size), false};
+  return true;
+}
+
+std::unique_ptr<const jsi::Buffer> PackFileBufferStore::getBuffer(
+    const std::string &bufferId) noexcept {
+  uint64_t keyHash = getPackKeyHash(bufferId);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  Location location;
+  if (!lookup(keyHash, location) ||
+      location.offset + location.size > pack_->size()) {
+    // It may have been appended since we last mapped the pack, by another
+    // store or by this one. Checking the size is a lot cheaper than mapping
+    // it again.
+    if (getFileSize(packFilePath_) <= (pack_ ? pack_->size() : 0) ||
+        !remap() || !lookup(keyHash, location)) {
+      return nullptr;
+    }
+  }
+
+  if (location.removed || location.offset > pack_->size() ||
+      location.size > pack_->size() - location.offset) {
+    return nullptr;
+  }
+
+  return std::make_unique<BufferViewBuffer>(
+      pack_,
+      static_cast<size_t>(location.offset),
+      static_cast<size_t>(location.size));
+}
+
+void PackFileBufferStore::prefetchBuffers(
+    const std::vector<std::string> &bufferIds) noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!pack_)
+    return;
+
+#ifdef _WIN32
+  SYSTEM_INFO systemInfo;
+  GetSystemInfo(&systemInfo);
+  uint64_t pageSize = systemInfo.dwPageSize;
+  std::vector<WIN32_MEMORY_RANGE_ENTRY> ranges;
+  ranges.reserve(bufferIds.size());
+#else
+  uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#endif
+
+  for (const std::string &bufferId : bufferIds) {
+    Location location;
+    if (!lookup(getPackKeyHash(bufferId), location) || location.removed ||
+        location.offset > pack_->size() ||
+        location.size > pack_->size() - location.offset) {
+      continue;
+    }
+
+    // The mapping itself is page aligned.
+    uint64_t begin = location.offset & ~(pageSize - 1);
+    void *address = const_cast<uint8_t *>(pack_->data()) + begin;
+    size_t length =
+        static_cast<size_t>(location.offset + location.size - begin);
+#ifdef _WIN32
+    ranges.push_back({address, length});
+#else
+    madvise(address, length, MADV_WILLNEED);
+#endif
+  }
+
+#ifdef _WIN32
+  if (!ranges.empty()) {
+    PrefetchVirtualMemory(
+        GetCurrentProcess(), ranges.size(), ranges.data(), 0);
+  }
+#endif
+}
+
+bool PackFileBufferStore::persistBuffer(
+    const std::string &bufferId,
+    std::unique_ptr<const jsi::Buffer> buffer) noexcept {
+  return persistBuffers(bufferId, {{buffer->data(), buffer->size()}});
+}
+
+bool PackFileBufferStore::persistBuffers(
+    const std::string &bufferId,
+    const std::vector<BufferSpan> &spans) noexcept {
+  return append(getPackKeyHash(bufferId), 0, spans);
+}
+
+bool PackFileBufferStore::removeBuffer(const std::string &bufferId) noexcept {
+  return append(getPackKeyHash(bufferId), PACK_RECORD_REMOVED, {});
+}
+
+bool PackFileBufferStore::append(
+    uint64_t keyHash,
+    uint32_t flags,
+    const std::vector<BufferSpan> &spans) noexcept {
+  if (getFileSize(packFilePath_) == 0) {
+    // Start an empty pack. Whoever gets there first wins, the others append to
+    // the winner's pack.
+    PackHeader header = makePackHeader(0, sizeof(PackHeader), nullptr, 0);
+    std::string tempPath = makeTempFilePath(packFilePath_);
+    if (!writeSpansToFile(
+            tempPath,
+            {{reinterpret_cast<const uint8_t *>(&header), sizeof(header)}}) ||
+        !moveFileIfAbsent(tempPath, packFilePath_)) {
+      std::remove(tempPath.c_str());
+    }
+  }
+
+  uint64_t size = 0;
+  for (const BufferSpan &span : spans) {
+    size += span.size;
+  }
+
+  PackRecordHeader record = makePackRecordHeader(keyHash, size, flags);
+
+  static const uint8_t padding[sizeof(PackRecordHeader) + 8] = {};
+
+  std::vector<BufferSpan> recordSpans;
+  recordSpans.reserve(spans.size() + 2);
+  recordSpans.push_back(
+      {reinterpret_cast<const uint8_t *>(&record), sizeof(record)});
+  recordSpans.insert(recordSpans.end(), spans.begin(), spans.end());
+  recordSpans.push_back(
+      {padding, static_cast<size_t>(alignPackOffset(size) - size)});
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  PackRecordHeader tornRecord;
+  bool padded = false;
+  uint64_t offset = 0;
+  if (!appendSpansToFile(
+          packFilePath_,
+          recordSpans,
+          [&](uint64_t fileSize, std::vector<FileWrite> &writes) {
+            // Unless another store appended since, the records end where our
+            // last one does, and there is nothing to map or scan.
+            if (fileSize != scannedSize_ && !remap())
+              return false;
+            if (scannedSize_ >= fileSize)
+              return true;
+
+            // Nobody else is appending, so what follows the last record that
+            // parses was torn by a crash. Records appended after it would be
+            // lost to lookups and to compact(), unless it is covered with a
+            // padding record. The file is zero filled up to the end of the
+            // padding first, so that its header never claims missing bytes.
+            uint64_t paddedSize = std::max(
+                alignPackOffset(fileSize),
+                scannedSize_ + sizeof(PackRecordHeader));
+            tornRecord = makePackRecordHeader(
+                0,
+                paddedSize - scannedSize_ - sizeof(PackRecordHeader),
+                PACK_RECORD_PADDING);
+            writes.push_back(
+                {fileSize,
+                 {{padding, static_cast<size_t>(paddedSize - fileSize)}}});
+            writes.push_back(
+                {scannedSize_,
+                 {{reinterpret_cast<const uint8_t *>(&tornRecord),
+                   sizeof(tornRecord)}}});
+            padded = true;
+            return true;
+          },
+          offset)) {
     return false;
+  }
+
+  if (padded)
+    scannedSize_ = offset;
 
-  file.write(reinterpret_cast<const char *>(buffer->data()), buffer->size());
-  file.close();
+  // Pick up our own record right away. It gets mapped when first read.
+  if (offset == scannedSize_) {
+    uint64_t dataOffset = offset + sizeof(PackRecordHeader);
+    appended_[keyHash] = {
+        dataOffset, size, (flags & PACK_RECORD_REMOVED) != 0};
+    scannedSize_ = alignPackOffset(dataOffset + size);
+  }
+  return true;
+}
+
+/*static*/ bool PackFileBufferStore::compact(
+    const std::string &storeDirectory) noexcept {
+  std::string packFilePath = storeDirectory + PACK_FILE_NAME;
+  std::string tempPath = makeTempFilePath(packFilePath);
+
+  {
+    PackFileBufferStore store(storeDirectory);
+    if (!store.pack_)
+      return getFileSize(packFilePath) == 0;
+
+    std::vector<std::pair<uint64_t, Location>> live;
+    live.reserve(store.indexedCount_ + store.appended_.size());
+    const PackIndexEntry *index = reinterpret_cast<const PackIndexEntry *>(
+        store.pack_->data() + sizeof(PackHeader));
+    for (uint32_t i = 0; i < store.indexedCount_; i++) {
+      uint64_t keyHash = littleEndian(index[i].keyHash);
+      if (store.appended_.count(keyHash) == 0) {
+        live.push_back(
+            {keyHash,
+             {littleEndian(index[i].offset),
+              littleEndian(index[i].size),
+              false}});
+      }
+    }
+    for (const auto &appended : store.appended_) {
+      if (!appended.second.removed)
+        live.push_back(appended);
+    }
+    live.erase(
+        std::remove_if(
+            live.begin(),
+            live.end(),
+            [&store](const std::pair<uint64_t, Location> &entry) {
+              return entry.second.offset > store.pack_->size() ||
+                  entry.second.size >
+                  store.pack_->size() - entry.second.offset;
+            }),
+        live.end());
+    std::sort(live.begin(), live.end(), [](const auto &a, const auto &b) {
+      return a.first < b.first;
+    });
+
+    static const uint8_t padding[8] = {};
+
+    std::vector<PackIndexEntry> newIndex;
+    std::vector<BufferSpan> dataSpans;
+    newIndex.reserve(live.size());
+    dataSpans.reserve(live.size() * 2);
+
+    uint64_t indexSize = live.size() * sizeof(PackIndexEntry);
+    uint64_t offset = sizeof(PackHeader) + indexSize;
+    for (const auto &entry : live) {
+      const Location &location = entry.second;
+      newIndex.push_back(
+          {littleEndian(entry.first),
+           littleEndian(offset),
+           littleEndian(location.size)});
+      dataSpans.push_back(
+          {store.pack_->data() + location.offset,
+           static_cast<size_t>(location.size)});
+      dataSpans.push_back(
+          {padding,
+           static_cast<size_t>(
+               alignPackOffset(location.size) - location.size)});
+      offset += alignPackOffset(location.size);
+    }
+
+    const uint8_t *indexData =
+        reinterpret_cast<const uint8_t *>(newIndex.data());
+    PackHeader header = makePackHeader(
+        static_cast<uint32_t>(newIndex.size()),
+        offset,
+        indexData,
+        static_cast<size_t>(indexSize));
+
+    std::vector<BufferSpan> spans;
+    spans.reserve(dataSpans.size() + 2);
+    spans.push_back(
+        {reinterpret_cast<const uint8_t *>(&header), sizeof(header)});
+    spans.push_back({indexData, static_cast<size_t>(indexSize)});
+    spans.insert(spans.end(), dataSpans.begin(), dataSpans.end());
+
+    if (!writeSpansToFile(tempPath, spans)) {
+      std::remove(tempPath.c_str());
+      return false;
+    }
+
+    // The pack must be unmapped before it can be replaced on Windows.
+  }
+
+  if (!replaceFile(tempPath, packFilePath)) {
+    std::remove(tempPath.c_str());
+    return false;
+  }
 
+  syncDirectory(storeDirectory);
   return true;
 }
 
@@ -187,28 +1675,58 @@ std::string BasePreparedScriptStoreImpl::getPreparedScriptFileName(
     const jsi::JSRuntimeSignature &runtimeSignature,
     const char *prepareTag) {
   // Essentially, we are trying to construct,
+  // prep_<script_version>_<runtime_id>_<preparation_tag>.cache
+  // or, when the version doesn't identify the content on its own,
+  // prep_<script_version>_<url_hash>_<runtime_id>_<preparation_tag>.cache
+  // or, when the script is not versioned,
   // prep_<source_url>_<runtime_id>_<preparation_tag>.cache
 
   std::string prparedScriptFileName("prep_");
 
   const std::string &scriptUrl = scriptSignature.url;
 
-  // As a crude heuristic we choose the last 64 characters of the source url.
-  constexpr int MAXLENGTH = 64;
-  prparedScriptFileName.append(
-      scriptUrl.begin() +
-          ((scriptUrl.size() < MAXLENGTH) ? 0 : (scriptUrl.size() - MAXLENGTH)),
-      scriptUrl.end());
-
-  // Make a valid file name.
-  std::replace(
-      prparedScriptFileName.begin(), prparedScriptFileName.end(), '\\', '_');
-  std::replace(
-      prparedScriptFileName.begin(), prparedScriptFileName.end(), '/', '_');
-  std::replace(
-      prparedScriptFileName.begin(), prparedScriptFileName.end(), ':', '_');
-  std::replace(
-      prparedScriptFileName.begin(), prparedScriptFileName.end(), '.', '_');
+  if (scriptSignature.version != 0) {
+    char versionHex[17];
+    snprintf(
+        versionHex,
+        sizeof(versionHex),
+        "%016" PRIx64,
+        static_cast<uint64_t>(scriptSignature.version));
+    prparedScriptFileName.append(versionHex);
+
+    // A content hash identifies the script, so keying on it alone is exact and
+    // lets every url serving the same bundle share one prepared script. Other
+    // versions, e.g. build numbers, are only meaningful per url.
+    if (!scriptSignature.contentVersion) {
+      char urlHashHex[18];
+      snprintf(
+          urlHashHex,
+          sizeof(urlHashHex),
+          "_%016" PRIx64,
+          jsi::xxhash64(
+              reinterpret_cast<const uint8_t *>(scriptUrl.data()),
+              scriptUrl.size()));
+      prparedScriptFileName.append(urlHashHex);
+    }
+  } else {
+    // As a crude heuristic we choose the last 64 characters of the source url.
+    constexpr int MAXLENGTH = 64;
+    prparedScriptFileName.append(
+        scriptUrl.begin() +
+            ((scriptUrl.size() < MAXLENGTH) ? 0
+                                            : (scriptUrl.size() - MAXLENGTH)),
+        scriptUrl.end());
+
+    // Make a valid file name.
+    std::replace(
+        prparedScriptFileName.begin(), prparedScriptFileName.end(), '\\', '_');
+    std::replace(
+        prparedScriptFileName.begin(), prparedScriptFileName.end(), '/', '_');
+    std::replace(
+        prparedScriptFileName.begin(), prparedScriptFileName.end(), ':', '_');
+    std::replace(
+        prparedScriptFileName.begin(), prparedScriptFileName.end(), '.', '_');
+  }
 
   if (runtimeSignature.runtimeName.empty()) {
     std::terminate();
@@ -222,15 +1740,108 @@ std::string BasePreparedScriptStoreImpl::getPreparedScriptFileName(
     prparedScriptFileName.append(prepareTag);
   }
 
-  // TODO :: Need to constuct a hash. ref:
-  // https://en.wikipedia.org/wiki/Base64#Filenames
-
   // extension
   prparedScriptFileName.append(".cache");
 
   return prparedScriptFileName;
 }
 
+BasePreparedScriptStoreImpl::BasePreparedScriptStoreImpl(
+    const std::string &storeDirectory,
+    PayloadVerification verification)
+    : BasePreparedScriptStoreImpl(
+          std::make_shared<LocalFileMappedBufferStore>(storeDirectory),
+          verification) {}
+
+BasePreparedScriptStoreImpl::BasePreparedScriptStoreImpl(
+    std::shared_ptr<BufferStore> bufferStore,
+    PayloadVerification verification)
+    : bufferStore_(std::move(bufferStore)) {
+  if (verification == PayloadVerification::Background) {
+    backgroundVerifier_ = std::make_unique<BackgroundVerifier>(bufferStore_);
+  }
+}
+
+BasePreparedScriptStoreImpl::~BasePreparedScriptStoreImpl() {
+  persistLoadManifest();
+}
+
+bool BasePreparedScriptStoreImpl::tryBeginPreparingScript(
+    const jsi::ScriptSignature &scriptSignature,
+    const jsi::JSRuntimeSignature &runtimeSignature,
+    const char *prepareTag) noexcept {
+  return bufferStore_->tryLockBuffer(getPreparedScriptFileName(
+      scriptSignature, runtimeSignature, prepareTag));
+}
+
+void BasePreparedScriptStoreImpl::endPreparingScript(
+    const jsi::ScriptSignature &scriptSignature,
+    const jsi::JSRuntimeSignature &runtimeSignature,
+    const char *prepareTag) noexcept {
+  bufferStore_->unlockBuffer(getPreparedScriptFileName(
+      scriptSignature, runtimeSignature, prepareTag));
+}
+
+void BasePreparedScriptStoreImpl::prefetchPreparedScripts() noexcept {
+  if (prefetched_.exchange(true))
+    return;
+
+  auto manifest = bufferStore_->getBuffer(LOAD_MANIFEST_ID);
+  if (!manifest)
+    return;
+
+  std::string text(
+      reinterpret_cast<const char *>(manifest->data()), manifest->size());
+  size_t headerSize = strlen(LOAD_MANIFEST_HEADER);
+  if (text.compare(0, headerSize, LOAD_MANIFEST_HEADER) != 0)
+    return;
+
+  std::vector<std::string> bufferIds;
+  for (size_t begin = headerSize, end; begin < text.size(); begin = end + 1) {
+    end = text.find('\n', begin);
+    if (end == std::string::npos)
+      end = text.size();
+    if (end > begin)
+      bufferIds.emplace_back(text, begin, end - begin);
+  }
+
+  bufferStore_->prefetchBuffers(bufferIds);
+
+  std::lock_guard<std::mutex> lock(loadManifestMutex_);
+  previousLoadManifest_ = std::move(text);
+}
+
+void BasePreparedScriptStoreImpl::recordLoad(
+    const std::string &bufferId) noexcept {
+  std::lock_guard<std::mutex> lock(loadManifestMutex_);
+  if (loadManifest_.size() < LOAD_MANIFEST_MAX_ENTRIES &&
+      loadManifestIds_.insert(bufferId).second) {
+    loadManifest_.push_back(bufferId);
+  }
+}
+
+void BasePreparedScriptStoreImpl::persistLoadManifest() noexcept {
+  std::string text(LOAD_MANIFEST_HEADER);
+  {
+    std::lock_guard<std::mutex> lock(loadManifestMutex_);
+    if (loadManifest_.empty())
+      return;
+
+    for (const std::string &bufferId : loadManifest_) {
+      text.append(bufferId);
+      text.append("\n");
+    }
+
+    if (text == previousLoadManifest_)
+      return;
+    previousLoadManifest_ = text;
+  }
+
+  bufferStore_->persistBuffers(
+      LOAD_MANIFEST_ID,
+      {{reinterpret_cast<const uint8_t *>(text.data()), text.size()}});
+}
+
 std::shared_ptr<const jsi::Buffer>
 BasePreparedScriptStoreImpl::tryGetPreparedScript(
     const jsi::ScriptSignature &scriptSignature,
@@ -239,9 +1850,18 @@ BasePreparedScriptStoreImpl::tryGetPreparedScript(
   std::string preparedScriptFilePath =
       getPreparedScriptFileName(scriptSignature, runtimeSignature, prepareTag);
 
+  // Misses are recorded too, the script is persisted right after.
+  recordLoad(preparedScriptFilePath);
+
+  if (backgroundVerifier_ &&
+      backgroundVerifier_->isCorrupted(preparedScriptFilePath)) {
+    return nullptr;
+  }
+
   auto buffer = bufferStore_->getBuffer(preparedScriptFilePath);
 
-  if (!buffer) {
+  if (!buffer || buffer->size() < sizeof(PreparedScriptPrefix) +
+                                       sizeof(PreparedScriptSuffix)) {
     return nullptr;
   }
 
@@ -254,19 +1874,32 @@ BasePreparedScriptStoreImpl::tryGetPreparedScript(
     return nullptr;
   }
 
-  if (prefix->scriptVersion != scriptSignature.version) {
+  if (prefix->formatVersion != PERSIST_FORMAT_VERSION) {
+    // Written by an older (or newer) store.
+    return nullptr;
+  }
+
+  if (littleEndian(prefix->scriptVersion) != scriptSignature.version) {
     // script version don't match!! Need to regenerate cache.
     return nullptr;
   }
 
-  if (prefix->runtimeVersion != runtimeSignature.version) {
+  if (littleEndian(prefix->runtimeVersion) != runtimeSignature.version) {
     // Runtime changed after the cache generation.
     return nullptr;
   }
 
-  if (prefix->sizeInBytes !=
-      buffer->size() - sizeof(PreparedScriptPrefix) -
-          sizeof(PreparedScriptSuffix)) {
+  uint64_t sizeInBytes = littleEndian(prefix->sizeInBytes);
+  uint32_t blockSize = littleEndian(prefix->blockSize);
+  if (blockSize == 0 || sizeInBytes > buffer->size()) {
+    return nullptr;
+  }
+
+  size_t blockCount = getBlockCount(sizeInBytes, blockSize);
+  size_t blockTableSize = getBlockTableSize(blockCount);
+  size_t payloadOffset = sizeof(PreparedScriptPrefix) + blockTableSize;
+  size_t framedSize = buffer->size() - sizeof(PreparedScriptSuffix);
+  if (payloadOffset > framedSize || sizeInBytes != framedSize - payloadOffset) {
     // Size is not as expected. Store is possibly corrupted .. It is safer to
     // bail out.
     return nullptr;
@@ -274,17 +1907,49 @@ BasePreparedScriptStoreImpl::tryGetPreparedScript(
 
   const PreparedScriptSuffix *suffix =
       reinterpret_cast<const PreparedScriptSuffix *>(
-          buffer->data() + sizeof(PreparedScriptPrefix) + prefix->sizeInBytes);
+          buffer->data() + payloadOffset + sizeInBytes);
   if (strncmp(suffix->eof, PERSIST_EOF, sizeof(suffix->eof)) != 0) {
     // magic value doesn't match!! The store is very likely corrupted or belongs
     // to old version.
     return nullptr;
   }
 
-  return std::make_shared<BufferViewBuffer>(
-      std::move(buffer),
-      sizeof(PreparedScriptPrefix),
-      static_cast<size_t>(prefix->sizeInBytes));
+  const uint8_t *blockTable = buffer->data() + sizeof(PreparedScriptPrefix);
+  if (getHeaderChecksum(*prefix, blockTable, blockTableSize) !=
+      littleEndian(prefix->headerChecksum)) {
+    return nullptr;
+  }
+
+  const uint32_t *blockChecksums =
+      reinterpret_cast<const uint32_t *>(blockTable);
+
+  if (!backgroundVerifier_) {
+    if (!verifyBlocks(
+            buffer->data() + payloadOffset,
+            static_cast<size_t>(sizeInBytes),
+            blockSize,
+            blockChecksums)) {
+      // The framing is intact but the payload isn't. Recompiling is far
+      // cheaper than feeding garbage to the VM.
+      return nullptr;
+    }
+
+    return std::make_shared<BufferViewBuffer>(
+        std::move(buffer), payloadOffset, static_cast<size_t>(sizeInBytes));
+  }
+
+  // The table is tiny compared to the payload, copy it so that the verifier
+  // doesn't depend on the framing.
+  std::vector<uint32_t> blockChecksumsCopy(
+      blockChecksums, blockChecksums + blockCount);
+
+  auto payload = std::make_shared<BufferViewBuffer>(
+      std::move(buffer), payloadOffset, static_cast<size_t>(sizeInBytes));
+  backgroundVerifier_->enqueue({preparedScriptFilePath,
+                                payload,
+                                blockSize,
+                                std::move(blockChecksumsCopy)});
+  return payload;
 }
 
 void BasePreparedScriptStoreImpl::persistPreparedScript(
@@ -292,38 +1957,51 @@ void BasePreparedScriptStoreImpl::persistPreparedScript(
     const jsi::ScriptSignature &scriptMetadata,
     const jsi::JSRuntimeSignature &runtimeMetadata,
     const char *prepareTag) noexcept {
-  // TODO :: Unfortunately, The current abstraction is forcing us to make a
-  // copy. Need to re-evaluate.
-  auto newBuffer = std::make_unique<ByteArrayBuffer>(
-      sizeof(PreparedScriptPrefix) + preparedScript->size() +
-      sizeof(PreparedScriptSuffix));
-
-  PreparedScriptPrefix *prefix =
-      reinterpret_cast<PreparedScriptPrefix *>(newBuffer->data());
-  memcpy_s(
-      prefix->magic,
-      sizeof(prefix->magic),
-      PERSIST_MAGIC,
-      sizeof(prefix->magic));
-  prefix->scriptVersion = scriptMetadata.version;
-  prefix->runtimeVersion = runtimeMetadata.version;
-  prefix->sizeInBytes = preparedScript->size();
-
-  memcpy_s(
-      newBuffer->data() + sizeof(PreparedScriptPrefix),
-      newBuffer->size() - sizeof(PreparedScriptPrefix),
-      preparedScript->data(),
-      preparedScript->size());
-
-  PreparedScriptSuffix *suffix = reinterpret_cast<PreparedScriptSuffix *>(
-      newBuffer->data() + sizeof(PreparedScriptPrefix) +
-      preparedScript->size());
-  memcpy_s(suffix->eof, sizeof(suffix->eof), PERSIST_EOF, sizeof(suffix->eof));
+  const uint8_t *payload = preparedScript->data();
+  size_t size = preparedScript->size();
+
+  size_t blockCount = getBlockCount(size, PERSIST_BLOCK_SIZE);
+  std::vector<uint32_t> blockChecksums(
+      getBlockTableSize(blockCount) / sizeof(uint32_t));
+  for (size_t block = 0; block < blockCount; block++) {
+    size_t offset = block * PERSIST_BLOCK_SIZE;
+    blockChecksums[block] = littleEndian(crc32c(
+        payload + offset,
+        std::min<size_t>(PERSIST_BLOCK_SIZE, size - offset)));
+  }
+
+  const uint8_t *blockTable =
+      reinterpret_cast<const uint8_t *>(blockChecksums.data());
+  size_t blockTableSize = blockChecksums.size() * sizeof(uint32_t);
+
+  PreparedScriptPrefix prefix = {};
+  memcpy(prefix.magic, PERSIST_MAGIC, sizeof(prefix.magic));
+  prefix.formatVersion = PERSIST_FORMAT_VERSION;
+  prefix.blockSize = littleEndian(PERSIST_BLOCK_SIZE);
+  prefix.scriptVersion = littleEndian(scriptMetadata.version);
+  prefix.runtimeVersion = littleEndian(runtimeMetadata.version);
+  prefix.sizeInBytes = littleEndian(static_cast<uint64_t>(size));
+  prefix.headerChecksum =
+      littleEndian(getHeaderChecksum(prefix, blockTable, blockTableSize));
+
+  PreparedScriptSuffix suffix = {};
+  memcpy(suffix.eof, PERSIST_EOF, sizeof(suffix.eof));
 
   std::string preparedScriptFilePath =
       getPreparedScriptFileName(scriptMetadata, runtimeMetadata, prepareTag);
 
-  bufferStore_->persistBuffer(preparedScriptFilePath, std::move(newBuffer));
+  // The payload is written straight from the compiler output, without being
+  // stitched together with the framing first.
+  bool persisted = bufferStore_->persistBuffers(
+      preparedScriptFilePath,
+      {{reinterpret_cast<const uint8_t *>(&prefix), sizeof(prefix)},
+       {blockTable, blockTableSize},
+       {payload, size},
+       {reinterpret_cast<const uint8_t *>(&suffix), sizeof(suffix)}});
+
+  if (persisted && backgroundVerifier_) {
+    backgroundVerifier_->forgetCorrupted(preparedScriptFilePath);
+  }
 }
 
 } // namespace react
@@ -4,19 +4,54 @@
 #include <jsi/jsi.h>
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <mutex>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace facebook {
 namespace react {
 
+// A contiguous range of bytes owned by the caller.
+struct BufferSpan {
+  const uint8_t *data;
+  size_t size;
+};
+
 struct BufferStore {
   virtual std::unique_ptr<const facebook::jsi::Buffer> getBuffer(
       const std::string &bufferId) noexcept = 0;
   virtual bool persistBuffer(
       const std::string &bufferId,
       std::unique_ptr<const facebook::jsi::Buffer>) noexcept = 0;
+
+  // Persist the concatenation of the spans as a single buffer. Stores which
+  // can write the spans out directly should override this. The default
+  // implementation stitches them into one buffer and calls persistBuffer.
+  virtual bool persistBuffers(
+      const std::string &bufferId,
+      const std::vector<BufferSpan> &spans) noexcept;
+
+  // Drop a persisted buffer. Stores which can't remove buffers return false.
+  virtual bool removeBuffer(const std::string &bufferId) noexcept {
+    return false;
+  }
+
+  // Start loading the buffers into memory ahead of the getBuffer calls for
+  // them. Must not block on the loads. Missing buffers are ignored.
+  virtual void prefetchBuffers(
+      const std::vector<std::string> &bufferIds) noexcept {}
+
+  // Advisory exclusive lock on a buffer id, shared with the other processes
+  // using the store. Doesn't block, returns false if the lock is held, by this
+  // or another process. Stores which can't lock always succeed.
+  virtual bool tryLockBuffer(const std::string &bufferId) noexcept {
+    return true;
+  }
+  virtual void unlockBuffer(const std::string &bufferId) noexcept {}
 };
 
 class LocalFileSimpleBufferStore : public BufferStore {
@@ -30,8 +65,119 @@ class LocalFileSimpleBufferStore : public BufferStore {
       const std::string &bufferId,
       std::unique_ptr<const facebook::jsi::Buffer>) noexcept override;
 
- private:
+  // Gathers the spans straight into a temporary file which is then renamed
+  // over the target, so readers only ever see the old or the new file.
+  bool persistBuffers(
+      const std::string &bufferId,
+      const std::vector<BufferSpan> &spans) noexcept override;
+
+  bool removeBuffer(const std::string &bufferId) noexcept override;
+
+  // Asks the OS to read the files ahead, all at once.
+  void prefetchBuffers(
+      const std::vector<std::string> &bufferIds) noexcept override;
+
+  // Locks one of a fixed set of lock files in the locks subdirectory of the
+  // store, picked by a hash of the buffer id, with flock on POSIX and by
+  // opening it exclusively on Windows. Either way the OS drops the lock if the
+  // process dies. The lock files are left behind on POSIX, removing them would
+  // race with other processes locking them, but there are never more than 256.
+  bool tryLockBuffer(const std::string &bufferId) noexcept override;
+  void unlockBuffer(const std::string &bufferId) noexcept override;
+
+ protected:
   std::string storeDirectory_;
+
+ private:
+  std::mutex locksMutex_;
+  // Open lock files by buffer id, HANDLEs on Windows and descriptors elsewhere.
+  std::unordered_map<std::string, intptr_t> locks_;
+};
+
+// Same on-disk layout as LocalFileSimpleBufferStore, but buffers are handed
+// out as read-only views over a memory mapping of the file instead of a heap
+// copy. Pages are faulted in lazily and are shared through the OS page cache
+// across runtimes and processes.
+class LocalFileMappedBufferStore : public LocalFileSimpleBufferStore {
+ public:
+  LocalFileMappedBufferStore(const std::string &storeDirectory)
+      : LocalFileSimpleBufferStore(storeDirectory) {}
+
+  std::unique_ptr<const facebook::jsi::Buffer> getBuffer(
+      const std::string &bufferId) noexcept override;
+};
+
+// Keeps all buffers in a single pack file in the store directory instead of
+// one file per buffer. The pack starts with an index of the buffers sorted by
+// the hash of their id, and is mapped once, so a lookup is a binary search
+// over memory rather than an open and a stat per buffer.
+//
+// New buffers are appended to the end of the pack, where they are found by a
+// scan when the pack is (re)mapped. Appends never touch existing records, so
+// several stores, in this or other processes, can share the pack. Removing a
+// buffer appends a record too. A record torn by a crash is covered with a
+// padding record by the next append, so that the records after it are found.
+// compact() folds the appended records into the index and drops removed
+// buffers; it must run while no store has the pack open, e.g. at install time.
+//
+// Buffers are identified by a 64 bit hash of their id only. Callers are
+// expected to validate what they get back, as BasePreparedScriptStoreImpl does.
+class PackFileBufferStore : public BufferStore {
+ public:
+  PackFileBufferStore(const std::string &storeDirectory);
+
+  std::unique_ptr<const facebook::jsi::Buffer> getBuffer(
+      const std::string &bufferId) noexcept override;
+  bool persistBuffer(
+      const std::string &bufferId,
+      std::unique_ptr<const facebook::jsi::Buffer>) noexcept override;
+  bool persistBuffers(
+      const std::string &bufferId,
+      const std::vector<BufferSpan> &spans) noexcept override;
+  bool removeBuffer(const std::string &bufferId) noexcept override;
+
+  // Asks the OS to page in the buffers' ranges of the mapping.
+  void prefetchBuffers(
+      const std::vector<std::string> &bufferIds) noexcept override;
+
+  // Same lock files as LocalFileSimpleBufferStore in the same directory.
+  bool tryLockBuffer(const std::string &bufferId) noexcept override {
+    return lockStore_.tryLockBuffer(bufferId);
+  }
+  void unlockBuffer(const std::string &bufferId) noexcept override {
+    lockStore_.unlockBuffer(bufferId);
+  }
+
+  static bool compact(const std::string &storeDirectory) noexcept;
+
+ private:
+  struct Location {
+    uint64_t offset;
+    uint64_t size;
+    bool removed;
+  };
+
+  // Caller must hold mutex_.
+  bool lookup(uint64_t keyHash, Location &location) noexcept;
+  bool remap() noexcept;
+
+  bool append(
+      uint64_t keyHash,
+      uint32_t flags,
+      const std::vector<BufferSpan> &spans) noexcept;
+
+  std::string packFilePath_;
+
+  std::mutex mutex_;
+  std::shared_ptr<const facebook::jsi::Buffer> pack_;
+  uint32_t indexedCount_{0};
+  // End of the records scanned so far.
+  uint64_t scannedSize_{0};
+  // Records appended since the last compaction, latest wins.
+  std::unordered_map<uint64_t, Location> appended_;
+
+  // Only used for its locks.
+  LocalFileSimpleBufferStore lockStore_;
 };
 
 struct ScriptVersionProvider {
@@ -49,6 +195,17 @@ struct PreparedScriptStoreNameGenerator {
   virtual std::string getStoreName(const std::string &url) noexcept = 0;
 };
 
+// When the payload checksums of a prepared script are checked.
+enum class PayloadVerification {
+  // Before tryGetPreparedScript returns.
+  Eager,
+  // On a background thread, after tryGetPreparedScript returns. Only the
+  // header and the checksum table are checked up front, which keeps the cost
+  // of a hit independent of the script size. A corrupted script is dropped
+  // from the store once detected.
+  Background,
+};
+
 // Dead simple implementation with local filesystem storage using standard c++
 // fileio but with optional extension point with custom bufferStore.
 class BasePreparedScriptStoreImpl : public facebook::jsi::PreparedScriptStore {
@@ -64,25 +221,66 @@ class BasePreparedScriptStoreImpl : public facebook::jsi::PreparedScriptStore {
       const facebook::jsi::JSRuntimeSignature &runtimeSignature,
       const char *prepareTag) noexcept override;
 
-  BasePreparedScriptStoreImpl(const std::string &storeDirectory)
-      : bufferStore_(
-            std::make_shared<LocalFileSimpleBufferStore>(storeDirectory)) {}
+  BasePreparedScriptStoreImpl(
+      const std::string &storeDirectory,
+      PayloadVerification verification = PayloadVerification::Eager);
+
+  BasePreparedScriptStoreImpl(
+      std::shared_ptr<BufferStore> bufferStore,
+      PayloadVerification verification = PayloadVerification::Eager);
+
+  // Prefetches the prepared scripts listed in the load manifest, i.e. the
+  // ones looked up during the previous run, in lookup order.
+  void prefetchPreparedScripts() noexcept override;
+
+  // Claims are locks on the prepared script's buffer id in the buffer store.
+  bool tryBeginPreparingScript(
+      const facebook::jsi::ScriptSignature &scriptSignature,
+      const facebook::jsi::JSRuntimeSignature &runtimeSignature,
+      const char *prepareTag) noexcept override;
+  void endPreparingScript(
+      const facebook::jsi::ScriptSignature &scriptSignature,
+      const facebook::jsi::JSRuntimeSignature &runtimeSignature,
+      const char *prepareTag) noexcept override;
+
+  // Saves the prepared scripts looked up so far as the load manifest for the
+  // next run. Best called once startup is over, so that the manifest covers
+  // exactly what startup needs. The destructor saves it too.
+  void persistLoadManifest() noexcept;
 
-  BasePreparedScriptStoreImpl(std::shared_ptr<BufferStore> bufferStore)
-      : bufferStore_(std::move(bufferStore)) {}
+  ~BasePreparedScriptStoreImpl();
 
  private:
+  class BackgroundVerifier;
+
+  void recordLoad(const std::string &bufferId) noexcept;
+
   std::string getPreparedScriptFileName(
       const facebook::jsi::ScriptSignature &scriptMetadata,
       const facebook::jsi::JSRuntimeSignature &runtimeMetadata,
       const char *prepareTag);
 
   std::shared_ptr<BufferStore> bufferStore_;
+  std::unique_ptr<BackgroundVerifier> backgroundVerifier_;
+
+  std::atomic<bool> prefetched_{false};
+  std::mutex loadManifestMutex_;
+  std::vector<std::string> loadManifest_;
+  std::unordered_set<std::string> loadManifestIds_;
+  // The manifest as read at startup, to avoid rewriting it unchanged.
+  std::string previousLoadManifest_;
 };
 
 // Dead simple script store implementation assuming that the script url is a
-// local filesystam path and assuming the script version is the script size, but
-// with extension point to provide custom version provider.
+// local filesystam path and using a hash of the script content as the version,
+// but with extension point to provide custom version provider.
+//
+// The hash is remembered along with the identity, size, modification and
+// change times of the file, so that an unchanged script is neither read nor
+// hashed again to get its version. It is remembered in memory, and given a
+// version cache directory, e.g. the one of the prepared script store, in a
+// file there named after a hash of the url, for the next processes too.
+// Writing that file is best effort.
 class BaseScriptStoreImpl : public facebook::jsi::ScriptStore {
  public:
   facebook::jsi::VersionedBuffer getVersionedScript(
@@ -93,10 +291,62 @@ class BaseScriptStoreImpl : public facebook::jsi::ScriptStore {
   BaseScriptStoreImpl(std::shared_ptr<ScriptVersionProvider> versionProvider)
       : versionProvider_{std::move(versionProvider)} {}
 
+  // The directory must exist and end with the path delimiter.
+  explicit BaseScriptStoreImpl(std::string versionCacheDirectory)
+      : versionCacheDirectory_{std::move(versionCacheDirectory)} {}
+
   BaseScriptStoreImpl() {}
 
+  // Without a version provider, versions are hashes of the script content.
+  bool hasContentVersions() noexcept override {
+    return !versionProvider_;
+  }
+
  private:
+  struct FileStamp {
+    // The volume and the file on it, replacing the file changes the latter.
+    uint64_t device;
+    uint64_t fileId;
+    uint64_t size;
+    // In the units of the platform, only ever compared for equality. Copies
+    // and extractions may keep the modification time, but not the change
+    // time, which is set by the file system only.
+    int64_t modified;
+    int64_t changed;
+    // Modified and changed long enough ago that another change within the
+    // resolution of those times is unlikely. Only such stamps are remembered.
+    bool settled;
+
+    bool operator==(const FileStamp &other) const noexcept {
+      return device == other.device && fileId == other.fileId &&
+          size == other.size && modified == other.modified &&
+          changed == other.changed;
+    }
+  };
+
+  struct CachedVersion {
+    FileStamp stamp;
+    facebook::jsi::ScriptVersion_t version;
+  };
+
+  static bool getFileStamp(const std::string &path, FileStamp &stamp) noexcept;
+
+  bool getCachedVersion(
+      const std::string &url,
+      const FileStamp &stamp,
+      facebook::jsi::ScriptVersion_t &version) noexcept;
+  void cacheVersion(
+      const std::string &url,
+      const FileStamp &stamp,
+      facebook::jsi::ScriptVersion_t version) noexcept;
+  std::string getVersionFilePath(const std::string &url) const;
+
   std::shared_ptr<ScriptVersionProvider> versionProvider_;
+  // Empty if the versions are only remembered in memory.
+  std::string versionCacheDirectory_;
+
+  std::mutex versionsMutex_;
+  std::unordered_map<std::string, CachedVersion> versions_;
 };
 
 } // namespace react
@@ -0,0 +1,125 @@
+#include "pch.h"
+
+#include "Crc32c.h"
+
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define CRC32C_HAS_SSE42_PATH
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC32C_TARGET_SSE42
+#else
+#include <cpuid.h>
+#define CRC32C_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#elif defined(__ARM_FEATURE_CRC32) || defined(_M_ARM64)
+#define CRC32C_HAS_ARM_PATH
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <arm_acle.h>
+#endif
+#endif
+
+namespace facebook {
+namespace react {
+
+namespace {
+
+constexpr uint32_t CRC32C_POLYNOMIAL = 0x82F63B78; // reflected 0x1EDC6F41
+
+struct Crc32cTable {
+  uint32_t entries[256];
+
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+      }
+      entries[i] = crc;
+    }
+  }
+};
+
+uint32_t crc32cSoftware(uint32_t crc, const uint8_t *data, size_t size) {
+  static const Crc32cTable table;
+  while (size--) {
+    crc = table.entries[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#ifdef CRC32C_HAS_SSE42_PATH
+
+bool cpuHasSse42() {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 20)) != 0;
+#else
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2) != 0;
+#endif
+}
+
+CRC32C_TARGET_SSE42 uint32_t
+crc32cHardware(uint32_t crc, const uint8_t *data, size_t size) {
+  uint64_t crc64 = crc;
+  while (size >= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += sizeof(word);
+    size -= sizeof(word);
+  }
+
+  crc = static_cast<uint32_t>(crc64);
+  while (size--) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+  return crc;
+}
+
+#elif defined(CRC32C_HAS_ARM_PATH)
+
+uint32_t crc32cHardware(uint32_t crc, const uint8_t *data, size_t size) {
+  while (size >= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = __crc32cd(crc, word);
+    data += sizeof(word);
+    size -= sizeof(word);
+  }
+
+  while (size--) {
+    crc = __crc32cb(crc, *data++);
+  }
+  return crc;
+}
+
+#endif
+
+} // namespace
+
+uint32_t crc32c(const uint8_t *data, size_t size, uint32_t crc) noexcept {
+  crc = ~crc;
+
+#if defined(CRC32C_HAS_SSE42_PATH)
+  static const bool useHardware = cpuHasSse42();
+  crc = useHardware ? crc32cHardware(crc, data, size)
+                    : crc32cSoftware(crc, data, size);
+#elif defined(CRC32C_HAS_ARM_PATH)
+  // The instructions are part of the baseline we compile for.
+  crc = crc32cHardware(crc, data, size);
+#else
+  crc = crc32cSoftware(crc, data, size);
+#endif
+
+  return ~crc;
+}
+
+} // namespace react
+} // namespace facebook
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace facebook {
+namespace react {
+
+// CRC-32C (Castagnoli), as used by iSCSI, ext4 and friends. Uses the SSE4.2 /
+// ARMv8 CRC instructions when the CPU has them and a table driven
+// implementation otherwise.
+//
+// Pass the result of a previous call as `crc` to checksum data incrementally.
+uint32_t crc32c(const uint8_t *data, size_t size, uint32_t crc = 0) noexcept;
+
+} // namespace react
+} // namespace facebook
@@ -0,0 +1,209 @@
+#include "pch.h"
+
+#include "LruPreparedScriptStore.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+using namespace facebook;
+
+namespace facebook {
+namespace react {
+
+LruPreparedScriptStore::LruPreparedScriptStore(
+    std::shared_ptr<jsi::PreparedScriptStore> preparedScriptStore,
+    size_t maxSizeInBytes)
+    : preparedScriptStore_(std::move(preparedScriptStore)),
+      maxSizeInBytes_(maxSizeInBytes) {
+  if (!preparedScriptStore_)
+    std::terminate();
+}
+
+/*static*/ std::string LruPreparedScriptStore::getCacheKey(
+    const jsi::ScriptSignature &scriptSignature,
+    const jsi::JSRuntimeSignature &runtimeSignature,
+    const char *prepareTag) {
+  char versions[64];
+  snprintf(
+      versions,
+      sizeof(versions),
+      "%016" PRIx64 "_%016" PRIx64,
+      scriptSignature.version,
+      runtimeSignature.version);
+
+  std::string key(versions);
+  key.append("_");
+  key.append(runtimeSignature.runtimeName);
+  key.append("_");
+  if (prepareTag)
+    key.append(prepareTag);
+
+  // Unless the version is a content hash, scripts at different urls can share
+  // it, and without a version the url is all we have to tell them apart.
+  if (!scriptSignature.contentVersion) {
+    key.append("_");
+    key.append(scriptSignature.url);
+  }
+
+  return key;
+}
+
+std::shared_ptr<const jsi::Buffer> LruPreparedScriptStore::tryGetPreparedScript(
+    const jsi::ScriptSignature &scriptSignature,
+    const jsi::JSRuntimeSignature &runtimeSignature,
+    const char *prepareTag) noexcept {
+  std::string key = getCacheKey(scriptSignature, runtimeSignature, prepareTag);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      entries_.splice(entries_.begin(), entries_, it->second);
+      hits_++;
+      return it->second->buffer;
+    }
+    misses_++;
+  }
+
+  // The backing store may go to disk, don't block other runtimes meanwhile.
+  auto buffer = preparedScriptStore_->tryGetPreparedScript(
+      scriptSignature, runtimeSignature, prepareTag);
+  if (!buffer)
+    return nullptr;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  return insert(std::move(key), std::move(buffer), false /*replace*/);
+}
+
+void LruPreparedScriptStore::persistPreparedScript(
+    std::shared_ptr<const jsi::Buffer> preparedScript,
+    const jsi::ScriptSignature &scriptSignature,
+    const jsi::JSRuntimeSignature &runtimeSignature,
+    const char *prepareTag) noexcept {
+  preparedScriptStore_->persistPreparedScript(
+      preparedScript, scriptSignature, runtimeSignature, prepareTag);
+
+  // The freshly compiled buffer is as good as what the backing store would
+  // hand back, minus the read.
+  std::lock_guard<std::mutex> lock(mutex_);
+  insert(
+      getCacheKey(scriptSignature, runtimeSignature, prepareTag),
+      std::move(preparedScript),
+      true /*replace*/);
+}
+
+void LruPreparedScriptStore::prefetchPreparedScripts() noexcept {
+  preparedScriptStore_->prefetchPreparedScripts();
+}
+
+bool LruPreparedScriptStore::tryBeginPreparingScript(
+    const jsi::ScriptSignature &scriptSignature,
+    const jsi::JSRuntimeSignature &runtimeSignature,
+    const char *prepareTag) noexcept {
+  return preparedScriptStore_->tryBeginPreparingScript(
+      scriptSignature, runtimeSignature, prepareTag);
+}
+
+void LruPreparedScriptStore::endPreparingScript(
+    const jsi::ScriptSignature &scriptSignature,
+    const jsi::JSRuntimeSignature &runtimeSignature,
+    const char *prepareTag) noexcept {
+  preparedScriptStore_->endPreparingScript(
+      scriptSignature, runtimeSignature, prepareTag);
+}
+
+PreparedScriptCacheStats LruPreparedScriptStore::getStats() noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return {hits_, misses_, evictions_, entries_.size(), sizeInBytes_};
+}
+
+std::shared_ptr<const jsi::Buffer> LruPreparedScriptStore::insert(
+    std::string key,
+    std::shared_ptr<const jsi::Buffer> buffer,
+    bool replace) {
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    if (!replace) {
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return it->second->buffer;
+    }
+    evict(it->second);
+  }
+
+  size_t size = buffer->size();
+  if (size > maxSizeInBytes_) {
+    // Caching it would flush everything else.
+    return buffer;
+  }
+
+  while (sizeInBytes_ + size > maxSizeInBytes_) {
+    evict(std::prev(entries_.end()));
+    evictions_++;
+  }
+
+  entries_.push_front({key, buffer});
+  index_.emplace(std::move(key), entries_.begin());
+  sizeInBytes_ += size;
+  return buffer;
+}
+
+void LruPreparedScriptStore::evict(std::list<Entry>::iterator it) {
+  sizeInBytes_ -= it->buffer->size();
+  index_.erase(it->key);
+  entries_.erase(it);
+}
+
+SharedPreparedScriptStore::SharedPreparedScriptStore(
+    std::shared_ptr<jsi::PreparedScriptStore> preparedScriptStore)
+    : preparedScriptStore_(std::move(preparedScriptStore)) {
+  if (!preparedScriptStore_)
+    std::terminate();
+}
+
+/*static*/ std::unique_ptr<jsi::PreparedScriptStore>
+SharedPreparedScriptStore::make(
+    std::shared_ptr<jsi::PreparedScriptStore> preparedScriptStore) {
+  return std::make_unique<SharedPreparedScriptStore>(
+      std::move(preparedScriptStore));
+}
+
+std::shared_ptr<const jsi::Buffer>
+SharedPreparedScriptStore::tryGetPreparedScript(
+    const jsi::ScriptSignature &scriptSignature,
+    const jsi::JSRuntimeSignature &runtimeSignature,
+    const char *prepareTag) noexcept {
+  return preparedScriptStore_->tryGetPreparedScript(
+      scriptSignature, runtimeSignature, prepareTag);
+}
+
+void SharedPreparedScriptStore::persistPreparedScript(
+    std::shared_ptr<const jsi::Buffer> preparedScript,
+    const jsi::ScriptSignature &scriptSignature,
+    const jsi::JSRuntimeSignature &runtimeSignature,
+    const char *prepareTag) noexcept {
+  preparedScriptStore_->persistPreparedScript(
+      std::move(preparedScript), scriptSignature, runtimeSignature, prepareTag);
+}
+
+void SharedPreparedScriptStore::prefetchPreparedScripts() noexcept {
+  preparedScriptStore_->prefetchPreparedScripts();
+}
+
+bool SharedPreparedScriptStore::tryBeginPreparingScript(
+    const jsi::ScriptSignature &scriptSignature,
+    const jsi::JSRuntimeSignature &runtimeSignature,
+    const char *prepareTag) noexcept {
+  return preparedScriptStore_->tryBeginPreparingScript(
+      scriptSignature, runtimeSignature, prepareTag);
+}
+
+void SharedPreparedScriptStore::endPreparingScript(
+    const jsi::ScriptSignature &scriptSignature,
+    const jsi::JSRuntimeSignature &runtimeSignature,
+    const char *prepareTag) noexcept {
+  preparedScriptStore_->endPreparingScript(
+      scriptSignature, runtimeSignature, prepareTag);
+}
+
+} // namespace react
+} // namespace facebook
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <jsi/ScriptStore.h>
+#include <jsi/jsi.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace facebook {
+namespace react {
+
+struct PreparedScriptCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t entries;
+  uint64_t sizeInBytes;
+};
+
+// Size bounded, thread safe, in-memory LRU cache in front of another prepared
+// script store (e.g. a BasePreparedScriptStoreImpl over any BufferStore).
+//
+// Meant to be created once per process and handed to every runtime, through
+// SharedPreparedScriptStore below, so that runtimes loading the same script
+// share a single buffer instead of each one reading (and verifying) it from
+// the backing store.
+//
+// Entries are only dropped on eviction, so a payload that the backing store
+// verifies in the background and later finds corrupted stays cached. Use
+// PayloadVerification::Eager for the backing store if that matters.
+class LruPreparedScriptStore : public facebook::jsi::PreparedScriptStore {
+ public:
+  LruPreparedScriptStore(
+      std::shared_ptr<facebook::jsi::PreparedScriptStore> preparedScriptStore,
+      size_t maxSizeInBytes);
+
+  std::shared_ptr<const facebook::jsi::Buffer> tryGetPreparedScript(
+      const facebook::jsi::ScriptSignature &scriptSignature,
+      const facebook::jsi::JSRuntimeSignature &runtimeSignature,
+      const char *prepareTag) noexcept override;
+
+  void persistPreparedScript(
+      std::shared_ptr<const facebook::jsi::Buffer> preparedScript,
+      const facebook::jsi::ScriptSignature &scriptSignature,
+      const facebook::jsi::JSRuntimeSignature &runtimeSignature,
+      const char *prepareTag) noexcept override;
+
+  void prefetchPreparedScripts() noexcept override;
+
+  // Forwarded to the backing store.
+  bool tryBeginPreparingScript(
+      const facebook::jsi::ScriptSignature &scriptSignature,
+      const facebook::jsi::JSRuntimeSignature &runtimeSignature,
+      const char *prepareTag) noexcept override;
+  void endPreparingScript(
+      const facebook::jsi::ScriptSignature &scriptSignature,
+      const facebook::jsi::JSRuntimeSignature &runtimeSignature,
+      const char *prepareTag) noexcept override;
+
+  PreparedScriptCacheStats getStats() noexcept;
+
+ private:
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const facebook::jsi::Buffer> buffer;
+  };
+
+  static std::string getCacheKey(
+      const facebook::jsi::ScriptSignature &scriptSignature,
+      const facebook::jsi::JSRuntimeSignature &runtimeSignature,
+      const char *prepareTag);
+
+  // Caller must hold mutex_. Returns the cached buffer, which is the existing
+  // one if another thread raced us to insert the same key.
+  std::shared_ptr<const facebook::jsi::Buffer> insert(
+      std::string key,
+      std::shared_ptr<const facebook::jsi::Buffer> buffer,
+      bool replace);
+
+  void evict(std::list<Entry>::iterator it);
+
+  std::shared_ptr<facebook::jsi::PreparedScriptStore> preparedScriptStore_;
+  const size_t maxSizeInBytes_;
+
+  std::mutex mutex_;
+  // Most recently used first.
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  size_t sizeInBytes_{0};
+
+  uint64_t hits_{0};
+  uint64_t misses_{0};
+  uint64_t evictions_{0};
+};
+
+// Forwards to a store shared with other runtimes, e.g. a
+// LruPreparedScriptStore, as the runtime factories take ownership of theirs.
+class SharedPreparedScriptStore : public facebook::jsi::PreparedScriptStore {
+ public:
+  explicit SharedPreparedScriptStore(
+      std::shared_ptr<facebook::jsi::PreparedScriptStore> preparedScriptStore);
+
+  static std::unique_ptr<facebook::jsi::PreparedScriptStore> make(
+      std::shared_ptr<facebook::jsi::PreparedScriptStore> preparedScriptStore);
+
+  std::shared_ptr<const facebook::jsi::Buffer> tryGetPreparedScript(
+      const facebook::jsi::ScriptSignature &scriptSignature,
+      const facebook::jsi::JSRuntimeSignature &runtimeSignature,
+      const char *prepareTag) noexcept override;
+
+  void persistPreparedScript(
+      std::shared_ptr<const facebook::jsi::Buffer> preparedScript,
+      const facebook::jsi::ScriptSignature &scriptSignature,
+      const facebook::jsi::JSRuntimeSignature &runtimeSignature,
+      const char *prepareTag) noexcept override;
+
+  void prefetchPreparedScripts() noexcept override;
+
+  bool tryBeginPreparingScript(
+      const facebook::jsi::ScriptSignature &scriptSignature,
+      const facebook::jsi::JSRuntimeSignature &runtimeSignature,
+      const char *prepareTag) noexcept override;
+  void endPreparingScript(
+      const facebook::jsi::ScriptSignature &scriptSignature,
+      const facebook::jsi::JSRuntimeSignature &runtimeSignature,
+      const char *prepareTag) noexcept override;
+
+ private:
+  std::shared_ptr<facebook::jsi::PreparedScriptStore> preparedScriptStore_;
+};
+
+} // namespace react
+} // namespace facebook
@@ -0,0 +1,337 @@
+#include "pch.h"
+
+#include "QuotaBufferStore.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace facebook;
+
+namespace facebook {
+namespace react {
+
+namespace {
+
+constexpr const char *QUOTA_INDEX_ID = "quota.index";
+constexpr char QUOTA_INDEX_MAGIC[8] = {'R', 'N', 'W', 'Q', 'U', 'O', 'T', 'A'};
+constexpr uint32_t QUOTA_INDEX_FORMAT_VERSION = 1;
+
+// The index is a header followed by the entries, each one a record header
+// followed by the buffer id.
+struct QuotaIndexHeader {
+  char magic[8];
+  uint32_t formatVersion;
+  uint32_t entryCount;
+};
+
+struct QuotaIndexRecord {
+  uint64_t size;
+  uint64_t lastAccess;
+  uint32_t idLength;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(QuotaIndexHeader) == 16, "Quota index layout changed.");
+static_assert(sizeof(QuotaIndexRecord) == 24, "Quota index layout changed.");
+
+} // namespace
+
+QuotaBufferStore::QuotaBufferStore(
+    std::shared_ptr<BufferStore> bufferStore,
+    const BufferStoreQuota &quota)
+    : bufferStore_(std::move(bufferStore)), quota_(quota) {
+  if (!bufferStore_)
+    std::terminate();
+
+  loadIndex();
+  sweeper_ = std::thread(&QuotaBufferStore::sweeperLoop, this);
+}
+
+QuotaBufferStore::~QuotaBufferStore() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wakeSweeper_.notify_one();
+  sweeper_.join();
+
+  std::string index;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!dirty_)
+      return;
+    index = serializeIndex();
+  }
+  bufferStore_->persistBuffers(
+      QUOTA_INDEX_ID,
+      {{reinterpret_cast<const uint8_t *>(index.data()), index.size()}});
+}
+
+/*static*/ uint64_t QuotaBufferStore::now() noexcept {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count());
+}
+
+bool QuotaBufferStore::isPinned(const std::string &bufferId) const noexcept {
+  for (const std::string &suffix : quota_.pinnedSuffixes) {
+    if (bufferId.size() >= suffix.size() &&
+        bufferId.compare(
+            bufferId.size() - suffix.size(), suffix.size(), suffix) == 0)
+      return true;
+  }
+  return false;
+}
+
+void QuotaBufferStore::loadIndex() noexcept {
+  std::unique_ptr<const jsi::Buffer> index =
+      bufferStore_->getBuffer(QUOTA_INDEX_ID);
+  if (!index || index->size() < sizeof(QuotaIndexHeader))
+    return;
+
+  QuotaIndexHeader header;
+  memcpy(&header, index->data(), sizeof(header));
+  if (memcmp(header.magic, QUOTA_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+      header.formatVersion != QUOTA_INDEX_FORMAT_VERSION)
+    return;
+
+  const uint8_t *cursor = index->data() + sizeof(header);
+  const uint8_t *end = index->data() + index->size();
+  for (uint32_t i = 0; i < header.entryCount; i++) {
+    QuotaIndexRecord record;
+    if (static_cast<size_t>(end - cursor) < sizeof(record))
+      break;
+    memcpy(&record, cursor, sizeof(record));
+    cursor += sizeof(record);
+
+    if (static_cast<size_t>(end - cursor) < record.idLength)
+      break;
+    std::string bufferId(
+        reinterpret_cast<const char *>(cursor), record.idLength);
+    cursor += record.idLength;
+
+    Entry &entry = entries_[bufferId];
+    sizeInBytes_ -= entry.size;
+    entry = {record.size, record.lastAccess};
+    sizeInBytes_ += entry.size;
+  }
+}
+
+std::string QuotaBufferStore::serializeIndex() const {
+  size_t size = sizeof(QuotaIndexHeader);
+  for (const auto &entry : entries_) {
+    size += sizeof(QuotaIndexRecord) + entry.first.size();
+  }
+
+  std::string index;
+  index.reserve(size);
+
+  QuotaIndexHeader header = {};
+  memcpy(header.magic, QUOTA_INDEX_MAGIC, sizeof(header.magic));
+  header.formatVersion = QUOTA_INDEX_FORMAT_VERSION;
+  header.entryCount = static_cast<uint32_t>(entries_.size());
+  index.append(reinterpret_cast<const char *>(&header), sizeof(header));
+
+  for (const auto &entry : entries_) {
+    QuotaIndexRecord record = {};
+    record.size = entry.second.size;
+    record.lastAccess = entry.second.lastAccess;
+    record.idLength = static_cast<uint32_t>(entry.first.size());
+    index.append(reinterpret_cast<const char *>(&record), sizeof(record));
+    index.append(entry.first);
+  }
+
+  return index;
+}
+
+std::unique_ptr<const jsi::Buffer> QuotaBufferStore::getBuffer(
+    const std::string &bufferId) noexcept {
+  std::unique_ptr<const jsi::Buffer> buffer = bufferStore_->getBuffer(bufferId);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(bufferId);
+  if (it != entries_.end()) {
+    if (buffer) {
+      it->second.lastAccess = now();
+    } else {
+      // Gone from the backing store, e.g. removed behind our back.
+      sizeInBytes_ -= it->second.size;
+      entries_.erase(it);
+    }
+    dirty_ = true;
+  }
+
+  return buffer;
+}
+
+bool QuotaBufferStore::persistBuffer(
+    const std::string &bufferId,
+    std::unique_ptr<const jsi::Buffer> buffer) noexcept {
+  uint64_t size = buffer->size();
+  if (!bufferStore_->persistBuffer(bufferId, std::move(buffer)))
+    return false;
+
+  track(bufferId, size);
+  return true;
+}
+
+bool QuotaBufferStore::persistBuffers(
+    const std::string &bufferId,
+    const std::vector<BufferSpan> &spans) noexcept {
+  if (!bufferStore_->persistBuffers(bufferId, spans))
+    return false;
+
+  uint64_t size = 0;
+  for (const BufferSpan &span : spans) {
+    size += span.size;
+  }
+
+  track(bufferId, size);
+  return true;
+}
+
+bool QuotaBufferStore::removeBuffer(const std::string &bufferId) noexcept {
+  if (!bufferStore_->removeBuffer(bufferId))
+    return false;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(bufferId);
+  if (it != entries_.end()) {
+    sizeInBytes_ -= it->second.size;
+    entries_.erase(it);
+    dirty_ = true;
+  }
+  return true;
+}
+
+void QuotaBufferStore::prefetchBuffers(
+    const std::vector<std::string> &bufferIds) noexcept {
+  bufferStore_->prefetchBuffers(bufferIds);
+}
+
+bool QuotaBufferStore::tryLockBuffer(const std::string &bufferId) noexcept {
+  return bufferStore_->tryLockBuffer(bufferId);
+}
+
+void QuotaBufferStore::unlockBuffer(const std::string &bufferId) noexcept {
+  bufferStore_->unlockBuffer(bufferId);
+}
+
+void QuotaBufferStore::track(
+    const std::string &bufferId,
+    uint64_t size) noexcept {
+  bool overBudget;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry &entry = entries_[bufferId];
+    sizeInBytes_ -= entry.size;
+    entry = {size, now()};
+    sizeInBytes_ += size;
+    dirty_ = true;
+    overBudget = sizeInBytes_ > quota_.maxSizeInBytes;
+    sweepRequested_ = sweepRequested_ || overBudget;
+  }
+
+  if (overBudget)
+    wakeSweeper_.notify_one();
+}
+
+void QuotaBufferStore::sweep() noexcept {
+  std::lock_guard<std::mutex> sweepLock(sweepMutex_);
+
+  std::vector<std::pair<std::string, Entry>> victims;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::vector<std::unordered_map<std::string, Entry>::iterator> candidates;
+    candidates.reserve(entries_.size());
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (!isPinned(it->first))
+        candidates.push_back(it);
+    }
+    std::sort(
+        candidates.begin(),
+        candidates.end(),
+        [](const std::unordered_map<std::string, Entry>::iterator &a,
+           const std::unordered_map<std::string, Entry>::iterator &b) {
+          return a->second.lastAccess < b->second.lastAccess;
+        });
+
+    uint64_t maxAge = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(quota_.maxAge)
+            .count());
+    uint64_t cutoff = now();
+    cutoff = maxAge && cutoff > maxAge ? cutoff - maxAge : 0;
+
+    for (auto it : candidates) {
+      if (sizeInBytes_ <= quota_.maxSizeInBytes &&
+          it->second.lastAccess >= cutoff)
+        break;
+
+      victims.emplace_back(it->first, it->second);
+      sizeInBytes_ -= it->second.size;
+      entries_.erase(it);
+    }
+
+    if (!victims.empty())
+      dirty_ = true;
+  }
+
+  // The removals are the slow part, they happen without the lock so that
+  // getBuffer calls carry on meanwhile.
+  std::vector<std::pair<std::string, Entry>> failed;
+  for (auto &victim : victims) {
+    if (!bufferStore_->removeBuffer(victim.first))
+      failed.push_back(std::move(victim));
+  }
+
+  std::string index;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    evictions_ += victims.size() - failed.size();
+
+    // Typically still open somewhere on Windows. Retried on the next sweep,
+    // unless the buffer was persisted again in the meantime.
+    for (auto &entry : failed) {
+      if (entries_.emplace(entry.first, entry.second).second)
+        sizeInBytes_ += entry.second.size;
+    }
+
+    if (!dirty_)
+      return;
+    index = serializeIndex();
+    dirty_ = false;
+  }
+
+  bufferStore_->persistBuffers(
+      QUOTA_INDEX_ID,
+      {{reinterpret_cast<const uint8_t *>(index.data()), index.size()}});
+}
+
+void QuotaBufferStore::sweeperLoop() noexcept {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    wakeSweeper_.wait_for(lock, quota_.sweepInterval, [this]() {
+      return stopping_ || sweepRequested_;
+    });
+    if (stopping_)
+      break;
+
+    // Only persists over budget cut the wait short, so buffers which can't be
+    // removed right now don't keep the sweeper spinning.
+    sweepRequested_ = false;
+
+    lock.unlock();
+    sweep();
+    lock.lock();
+  }
+}
+
+QuotaBufferStoreStats QuotaBufferStore::getStats() noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return {entries_.size(), sizeInBytes_, evictions_};
+}
+
+} // namespace react
+} // namespace facebook
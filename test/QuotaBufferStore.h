@@ -0,0 +1,112 @@
+#pragma once
+
+#include "BaseScriptStoreImpl.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace facebook {
+namespace react {
+
+struct BufferStoreQuota {
+  uint64_t maxSizeInBytes;
+  // Buffers not accessed for longer than this are evicted even when the store
+  // is within budget. Zero keeps them as long as there is room.
+  std::chrono::seconds maxAge{0};
+  // How often the sweeper runs when not woken up by a persist over budget.
+  std::chrono::seconds sweepInterval{60};
+  // Buffers whose id ends with one of these count towards the budget but are
+  // never evicted, e.g. "_debug-source.cache" for the sources a debug runtime
+  // keeps in the store instead of in memory.
+  std::vector<std::string> pinnedSuffixes;
+};
+
+struct QuotaBufferStoreStats {
+  uint64_t entries;
+  uint64_t sizeInBytes;
+  uint64_t evictions;
+};
+
+// Keeps another buffer store (e.g. a LocalFileSimpleBufferStore) within a byte
+// budget by evicting the least recently accessed buffers, and optionally the
+// ones which haven't been accessed for too long.
+//
+// Sizes and access times of the buffers persisted through it are kept in an
+// index, itself a buffer of the backing store, which is loaded on construction
+// and saved after every sweep and on destruction. Buffers persisted before the
+// index existed are not tracked and never evicted.
+//
+// Evictions happen on a background thread. getBuffer only stamps the access
+// time in memory, so lookups never wait on the file system for the sweeper.
+class QuotaBufferStore : public BufferStore {
+ public:
+  QuotaBufferStore(
+      std::shared_ptr<BufferStore> bufferStore,
+      const BufferStoreQuota &quota);
+  ~QuotaBufferStore();
+
+  std::unique_ptr<const facebook::jsi::Buffer> getBuffer(
+      const std::string &bufferId) noexcept override;
+  bool persistBuffer(
+      const std::string &bufferId,
+      std::unique_ptr<const facebook::jsi::Buffer>) noexcept override;
+  bool persistBuffers(
+      const std::string &bufferId,
+      const std::vector<BufferSpan> &spans) noexcept override;
+  bool removeBuffer(const std::string &bufferId) noexcept override;
+  void prefetchBuffers(
+      const std::vector<std::string> &bufferIds) noexcept override;
+  bool tryLockBuffer(const std::string &bufferId) noexcept override;
+  void unlockBuffer(const std::string &bufferId) noexcept override;
+
+  // Runs a sweep on the calling thread, e.g. before shutting down.
+  void sweep() noexcept;
+
+  QuotaBufferStoreStats getStats() noexcept;
+
+ private:
+  struct Entry {
+    uint64_t size;
+    // Milliseconds since the epoch, which keeps the index meaningful across
+    // runs.
+    uint64_t lastAccess;
+  };
+
+  static uint64_t now() noexcept;
+  bool isPinned(const std::string &bufferId) const noexcept;
+
+  void loadIndex() noexcept;
+  // Caller must hold mutex_.
+  std::string serializeIndex() const;
+
+  void track(const std::string &bufferId, uint64_t size) noexcept;
+  void sweeperLoop() noexcept;
+
+  std::shared_ptr<BufferStore> bufferStore_;
+  const BufferStoreQuota quota_;
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  uint64_t sizeInBytes_{0};
+  uint64_t evictions_{0};
+  // Whether entries_ changed since the index was last saved.
+  bool dirty_{false};
+
+  // Serializes sweeps, so that a sweep() call can't interleave with the
+  // sweeper's.
+  std::mutex sweepMutex_;
+
+  std::condition_variable wakeSweeper_;
+  bool sweepRequested_{false};
+  bool stopping_{false};
+  std::thread sweeper_;
+};
+
+} // namespace react
+} // namespace facebook